@@ -1,16 +1,33 @@
 #pragma once
 
+#include <cstdint>
 #include <utility>
+#include <vector>
+#include <algorithm>
+#include <tuple>
 #include <memory>
+#include <atomic>
+#include <new>
+#include <type_traits>
 #include <stdexcept>
 #include <shared_mutex>
 
+#include "SlabAllocator.hpp"
+#include "Epoch.hpp"
+#include "ThreadPool.hpp"
+#include "Frozen.hpp"
+#include "Mapped.hpp"
+#include "Transaction.hpp"
+#include "Combiner.hpp"
+#include "WriteBatch.hpp"
+
 namespace AVLtree {
     std::size_t compare(std::size_t a, std::size_t b) {
         return (a > b) ? a : b;
     }
 
-    enum states {
+    // one byte, so it packs next to the height in a node
+    enum states : unsigned char {
         REMOVED,
         DESTROY,
         BEGIN,
@@ -25,20 +42,39 @@ namespace AVLtree {
         using base_class::base_class;
     };
 
+    // stands in for Epoch::Guard where nodes are reference counted and nothing has to be pinned
+    struct NoGuard {
+        NoGuard() {}
+    };
+
     template<typename NODE>
     class SmartPointer {
     public:
         using node_type = NODE;
 
-        template<typename KEY, typename DATA>
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
         friend class Node;
 
-        template<typename KEY, typename DATA>
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
         friend class AVLiterator;
 
-        template<typename KEY, typename DATA>
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
         friend class AVL;
 
+        using guard_type = NoGuard;
+        using handle_type = SmartPointer;
+
+        static const bool detachable = false;
+        static const bool deferred = false;
+
+        static void adopt(node_type *) {}
+        static void retire(node_type *) {}
+
+        // every node also costs its Core
+        static std::size_t node_overhead() {
+            return sizeof(Core);
+        }
+
         explicit SmartPointer(node_type *tmp) {
             if (tmp == nullptr) {
                 this->core = nullptr;
@@ -81,39 +117,31 @@ namespace AVLtree {
             if (this->core->ptr->state == states::DESTROY)
                 this->core->ref_count = 1;
 
-            this->core->ref_count--;
-            if (this->core->ref_count == 0) {
+            if (--this->core->ref_count == 0) {
                 this->core->ptr->parent = nullptr;
                 delete this->core;
             }
         }
 
+        // tmp may be a link inside the very node this lets go of, so it is read before del()
         SmartPointer &operator=(const SmartPointer &tmp) {
-            if (tmp.core == nullptr) {
-                this->del();
-                this->core = nullptr;
-
-                return *this;
-            }
+            Core *core = tmp.core;
+            if (core != nullptr) core->ref_count++;
 
             this->del();
-            tmp.core->ref_count++;
-            this->core = tmp.core;
+            this->core = core;
 
             return *this;
         }
 
         SmartPointer &operator=(SmartPointer &&tmp) {
-            if (tmp.core == nullptr) {
-                this->del();
-                this->core = nullptr;
+            if (this == &tmp) return *this;
 
-                return *this;
-            }
+            Core *core = tmp.core;
+            tmp.core = nullptr;
 
             this->del();
-            this->core = tmp.core;
-            tmp.core = nullptr;
+            this->core = core;
 
             return *this;
         }
@@ -203,9 +231,8 @@ namespace AVLtree {
         void del() {
             if (this->core == nullptr) return;
 
-            this->core->ref_count--;
-
-            if (this->core->ref_count == 0) {
+            // one atomic step, iterators on other threads may be letting go of the same node
+            if (--this->core->ref_count == 0) {
                 this->core->ptr->parent = nullptr;
                 delete this->core;
                 this->core = nullptr;
@@ -215,32 +242,384 @@ namespace AVLtree {
         Core *core = nullptr;
     };
 
-    template<typename KEY, typename DATA>
+    // Same interface as SmartPointer, but the reference count lives in the node itself,
+    // so a node costs one allocation and a dereference is a single pointer hop.
+    template<typename NODE>
+    class IntrusivePointer {
+    public:
+        using node_type = NODE;
+
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
+        friend class Node;
+
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
+        friend class AVLiterator;
+
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
+        friend class AVL;
+
+        using guard_type = NoGuard;
+        using handle_type = IntrusivePointer;
+
+        static const bool detachable = true;
+        static const bool deferred = false;
+
+        static void adopt(node_type *) {}
+        static void retire(node_type *) {}
+
+        static std::size_t node_overhead() {
+            return 0;
+        }
+
+        explicit IntrusivePointer(node_type *tmp) : ptr(tmp) {
+            if (this->ptr != nullptr) this->ptr->ref_count++;
+        }
+
+        IntrusivePointer() {}
+
+        IntrusivePointer(const IntrusivePointer &tmp) : ptr(tmp.ptr) {
+            if (this->ptr != nullptr) this->ptr->ref_count++;
+        }
+
+        IntrusivePointer(IntrusivePointer &&tmp) : ptr(tmp.ptr) {
+            tmp.ptr = nullptr;
+        }
+
+        ~IntrusivePointer() {
+            if (this->ptr == nullptr) return;
+
+            if (this->ptr->state == states::DESTROY)
+                this->ptr->ref_count = 1;
+
+            this->del();
+        }
+
+        // tmp may be a link inside the very node this lets go of, so it is read before del()
+        IntrusivePointer &operator=(const IntrusivePointer &tmp) {
+            node_type *ptr = tmp.ptr;
+            if (ptr != nullptr) ptr->ref_count++;
+
+            this->del();
+            this->ptr = ptr;
+
+            return *this;
+        }
+
+        IntrusivePointer &operator=(IntrusivePointer &&tmp) {
+            if (this == &tmp) return *this;
+
+            node_type *ptr = tmp.ptr;
+            tmp.ptr = nullptr;
+
+            this->del();
+            this->ptr = ptr;
+
+            return *this;
+        }
+
+        IntrusivePointer &operator=(node_type *tmp) {
+            if (tmp != nullptr) tmp->ref_count++;
+
+            this->del();
+            this->ptr = tmp;
+
+            return *this;
+        }
+
+        node_type &operator*() {
+            if (this->ptr == nullptr) {
+                throw AVLtree::exception();
+            }
+
+            return *(this->ptr);
+        }
+
+        const node_type &operator*() const {
+            if (this->ptr == nullptr) {
+                throw AVLtree::exception();
+            }
+
+            return *(this->ptr);
+        }
+
+        node_type* operator->() const {
+            return this->ptr;
+        }
+
+        node_type* get() const {
+            return this->ptr;
+        }
+
+        operator bool() const {
+            return this->ptr != nullptr;
+        }
+
+        template<typename U>
+        bool operator==(const IntrusivePointer<U> &tmp) const {
+            return static_cast<void*>(tmp.get()) == static_cast<void*>(this->get());
+        }
+
+        template<typename U>
+        bool operator!=(const IntrusivePointer<U> &tmp) const {
+            return !(*this == tmp);
+        }
+
+        std::size_t count_owners() const {
+            if (this->ptr == nullptr) return 0;
+            else return this->ptr->ref_count;
+        }
+
+    private:
+        // drops the node without touching its reference count, for when its memory is released in bulk
+        void forget() {
+            this->ptr = nullptr;
+        }
+
+        void del() {
+            if (this->ptr == nullptr) return;
+
+            node_type *tmp = this->ptr;
+            this->ptr = nullptr;
+
+            if (--tmp->ref_count == 0) {
+                tmp->parent = nullptr;
+                delete tmp;
+            }
+        }
+
+        node_type *ptr = nullptr;
+    };
+
+    template<typename NODE>
+    class PinnedPointer;
+
+    // Plain pointer for the tree's own links, copying it costs nothing, so walking the tree doesn't touch
+    // any counter. A linked node carries one pin for the tree; remove() retires it to the Epoch, and it is
+    // freed once the epoch has moved on and nothing pins it any more: neither an iterator standing on it
+    // nor a removed node linking to it. Removed nodes pin what they link to, so iterators can walk on.
+    template<typename NODE>
+    class EpochPointer {
+    public:
+        using node_type = NODE;
+
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
+        friend class Node;
+
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
+        friend class AVLiterator;
+
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
+        friend class AVL;
+
+        using guard_type = Epoch::Guard;
+        using handle_type = PinnedPointer<NODE>;
+
+        static const bool detachable = false;
+        static const bool deferred = true;
+
+        static void adopt(node_type *node) {
+            node->ref_count = 1;
+        }
+
+        static std::size_t node_overhead() {
+            return 0;
+        }
+
+        // called for every node that leaves the tree, the sentinel of an emptied tree included
+        static void retire(node_type *node) {
+            node->state = states::REMOVED;
+            if (node->parent) node->parent->ref_count++;
+            if (node->left) node->left->ref_count++;
+            if (node->right) node->right->ref_count++;
+
+            Epoch::retire(node, &EpochPointer::unpin_node);
+        }
+
+        // drops one pin; only removed nodes hold pins on their links, so only they hand them back
+        static void unpin(node_type *node) {
+            if (--node->ref_count != 0) return;
+
+            std::vector<node_type*> nodes(1, node);
+            while (!nodes.empty()) {
+                node_type *tmp = nodes.back();
+                nodes.pop_back();
+
+                if (tmp->state == states::REMOVED) {
+                    node_type *links[3] = { tmp->parent.get(), tmp->left.get(), tmp->right.get() };
+                    for (node_type *link : links) {
+                        if ((link != nullptr) && (--link->ref_count == 0)) nodes.push_back(link);
+                    }
+                }
+
+                delete tmp;
+            }
+        }
+
+        explicit EpochPointer(node_type *tmp) : ptr(tmp) {}
+
+        EpochPointer() {}
+
+        EpochPointer &operator=(node_type *tmp) {
+            this->ptr = tmp;
+            return *this;
+        }
+
+        node_type &operator*() const {
+            if (this->ptr == nullptr) {
+                throw AVLtree::exception();
+            }
+
+            return *(this->ptr);
+        }
+
+        node_type* operator->() const {
+            return this->ptr;
+        }
+
+        node_type* get() const {
+            return this->ptr;
+        }
+
+        operator bool() const {
+            return this->ptr != nullptr;
+        }
+
+        template<typename U>
+        bool operator==(const EpochPointer<U> &tmp) const {
+            return static_cast<void*>(tmp.get()) == static_cast<void*>(this->get());
+        }
+
+        template<typename U>
+        bool operator!=(const EpochPointer<U> &tmp) const {
+            return !(*this == tmp);
+        }
+
+    private:
+        static void unpin_node(void *tmp) {
+            unpin(static_cast<node_type*>(tmp));
+        }
+
+        node_type *ptr = nullptr;
+    };
+
+    // What an iterator holds under EpochPointer: one pin on the node it stands on.
+    template<typename NODE>
+    class PinnedPointer {
+    public:
+        using node_type = NODE;
+
+        PinnedPointer() {}
+
+        PinnedPointer(const EpochPointer<NODE> &tmp) : ptr(tmp.get()) {
+            if (this->ptr != nullptr) this->ptr->ref_count++;
+        }
+
+        PinnedPointer(const PinnedPointer &tmp) : ptr(tmp.ptr) {
+            if (this->ptr != nullptr) this->ptr->ref_count++;
+        }
+
+        PinnedPointer(PinnedPointer &&tmp) : ptr(tmp.ptr) {
+            tmp.ptr = nullptr;
+        }
+
+        ~PinnedPointer() {
+            this->del();
+        }
+
+        PinnedPointer &operator=(const PinnedPointer &tmp) {
+            return *this = tmp.ptr;
+        }
+
+        PinnedPointer &operator=(const EpochPointer<NODE> &tmp) {
+            return *this = tmp.get();
+        }
+
+        PinnedPointer &operator=(node_type *tmp) {
+            if (tmp != nullptr) tmp->ref_count++;
+            this->del();
+            this->ptr = tmp;
+
+            return *this;
+        }
+
+        node_type &operator*() const {
+            if (this->ptr == nullptr) {
+                throw AVLtree::exception();
+            }
+
+            return *(this->ptr);
+        }
+
+        node_type* operator->() const {
+            return this->ptr;
+        }
+
+        node_type* get() const {
+            return this->ptr;
+        }
+
+        operator bool() const {
+            return this->ptr != nullptr;
+        }
+
+        template<typename P>
+        bool operator==(const P &tmp) const {
+            return static_cast<void*>(tmp.get()) == static_cast<void*>(this->get());
+        }
+
+        template<typename P>
+        bool operator!=(const P &tmp) const {
+            return !(*this == tmp);
+        }
+
+    private:
+        void del() {
+            if (this->ptr == nullptr) return;
+
+            node_type *tmp = this->ptr;
+            this->ptr = nullptr;
+            EpochPointer<NODE>::unpin(tmp);
+        }
+
+        node_type *ptr = nullptr;
+    };
+
+    template<typename KEY, typename DATA, template<typename> class POINTER = IntrusivePointer,
+        typename ALLOC = HeapAllocator>
     class Node {
     protected:
         using key_type = KEY;
         using data_type = DATA;
         using state_for_node = states;
+        using height_type = std::uint8_t;
         using value_type = std::pair<const key_type, data_type>;
-        using smart_ptr = SmartPointer<Node>;
+        using smart_ptr = POINTER<Node>;
         using size_type = std::size_t;
 
-        template<typename KEY, typename DATA>
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
         friend class AVL;
 
-        template<typename KEY, typename DATA>
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
         friend class AVLiterator;
 
         template<typename NODE>
         friend class SmartPointer;
 
-        Node() : parent(), left(), right(), height(0), state(states::FREE) {}
+        template<typename NODE>
+        friend class IntrusivePointer;
 
-        Node(const value_type &val) : Node() {
-            new (&this->data) value_type(std::move(val)); //placement new
-            this->state = states::VALID;
-            this->height = 1;
-        }
+        template<typename NODE>
+        friend class EpochPointer;
+
+        template<typename NODE>
+        friend class PinnedPointer;
+
+        Node() : ref_count(0), height(0), state(states::FREE), tombstone(false), parent(), left(), right(), count(0) {}
+
+        // builds the payload in place from whatever value_type's constructors accept
+        template<typename... ARGS>
+        Node(state_for_node st, ARGS&&... args) : data(std::forward<ARGS>(args)...), ref_count(0), height(1),
+            state(st), tombstone(false), parent(), left(), right(), count(1) {}
 
         ~Node() {
             if (this->state == states::DESTROY) {
@@ -249,28 +628,44 @@ namespace AVLtree {
             }
         }
 
+        static void operator delete(void *ptr, std::size_t size) {
+            ALLOC::deallocate(ptr, size);
+        }
+
+        // Ordered so the small fields share one word: for AVL<int, int> on 64 bits a node is 48 bytes, not 64.
         value_type data;
 
+        // IntrusivePointer's count, or EpochPointer's pins; SmartPointer keeps its count in a separate Core
+        std::atomic<std::uint32_t> ref_count;
+        // an AVL tree never gets near 256 levels
+        height_type height;
+        state_for_node state;
+        // erased by a lazy erase but still linked in, until the next compaction takes it out
+        std::atomic<bool> tombstone;
+
         smart_ptr parent;
         smart_ptr left;
         smart_ptr right;
 
-        size_type height;
-        state_for_node state;
+        // live nodes in the subtree, this one included unless it's a tombstone; atomic because a lazy erase
+        // lowers it on the way up under the shared lock
+        std::atomic<size_type> count;
     };
 
-    template<typename KEY, typename DATA>
+    template<typename KEY, typename DATA, template<typename> class POINTER = IntrusivePointer,
+        typename ALLOC = HeapAllocator>
     class AVLiterator {
     public:
         using key_type = KEY;
         using data_type = DATA;
-        using node_type = Node<key_type, data_type>;
+        using node_type = Node<key_type, data_type, POINTER, ALLOC>;
         using state_for_iterator = states;
-        using pointer = SmartPointer<node_type>;
+        using link = POINTER<node_type>;
+        using pointer = typename link::handle_type;
         using reference = node_type&;
         using value_type = std::pair<const key_type, data_type>;
 
-        template<typename KEY, typename DATA>
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
         friend class AVL;
 
         AVLiterator() noexcept : ptr(), end_(), state(FREE) {}
@@ -290,10 +685,12 @@ namespace AVLtree {
             return this->ptr->data.second;
         }
 
-        void operator=(const pointer &smart_ptr) {
+        template<typename P>
+        void operator=(const P &smart_ptr) {
             if (smart_ptr) {
+                // smart_ptr may live in the node the iterator is leaving, which can be gone after this
                 this->ptr = smart_ptr;
-                this->state = smart_ptr->state;
+                this->state = this->ptr->state;
             }
         }
 
@@ -318,36 +715,49 @@ namespace AVLtree {
             return this->ptr != right.ptr;
         }
 
+        // Moving only rewrites the iterator itself and the nodes' reference counts, which are atomic, so any
+        // number of iterators can move side by side under the shared lock; writers still keep them out.
+
         // postfix ++
         AVLiterator operator++(int) {
-            std::unique_lock<std::shared_mutex> guard(*mutex);
+            std::shared_lock<std::shared_mutex> guard(*mutex);
+            typename link::guard_type epoch;
             AVLiterator tmp;
             tmp = *this;
             plus();
+            skip_forward();
 
             return tmp;
         }
 
         // prefix ++
         AVLiterator& operator++() {
-            std::unique_lock<std::shared_mutex> guard(*mutex);
-            return plus();
+            std::shared_lock<std::shared_mutex> guard(*mutex);
+            typename link::guard_type epoch;
+            plus();
+
+            return skip_forward();
         }
 
         // postfix --
         AVLiterator operator--(int) {
-            std::unique_lock<std::shared_mutex> guard(*mutex);
+            std::shared_lock<std::shared_mutex> guard(*mutex);
+            typename link::guard_type epoch;
             AVLiterator tmp;
             tmp = *this;
             minus();
+            skip_back();
 
             return tmp;
         }
 
         // prefix --
         AVLiterator& operator--() {
-            std::unique_lock<std::shared_mutex> guard(*mutex);
-            return minus();
+            std::shared_lock<std::shared_mutex> guard(*mutex);
+            typename link::guard_type epoch;
+            minus();
+
+            return skip_back();
         }
 
     protected:
@@ -369,7 +779,7 @@ namespace AVLtree {
                         return *this;
                     }
                     else {
-                        pointer temp = this->ptr->parent;
+                        link temp = this->ptr->parent;
                         while (temp->state != states::VALID) temp = temp->parent;
                         this->ptr = temp;
 
@@ -385,7 +795,7 @@ namespace AVLtree {
                         *this = this->ptr->parent;
                     }
                     else {
-                        pointer temp = this->ptr->parent;
+                        link temp = this->ptr->parent;
                         while (temp->data.first < this->ptr->data.first) temp = temp->parent;
                         *this = temp;
                     }
@@ -410,7 +820,7 @@ namespace AVLtree {
                         return *this;
                     }
                     else {
-                        pointer temp = this->ptr->parent;
+                        link temp = this->ptr->parent;
                         while (temp->state != states::VALID) temp = temp->parent;
                         this->ptr = temp;
 
@@ -431,7 +841,7 @@ namespace AVLtree {
                         *this = this->ptr->parent;
                     }
                     else {
-                        pointer temp = this->ptr->parent;
+                        link temp = this->ptr->parent;
                         while (temp->data.first > this->ptr->data.first) temp = temp->parent;
                         *this = temp;
                     }
@@ -442,15 +852,30 @@ namespace AVLtree {
             return *this;
         }
 
-        pointer find_min(pointer &node) {
-            pointer tmp = node;
-            while (tmp->left) tmp = tmp->left;
+        // a step that lands on a tombstone goes on to the next key
+        AVLiterator& skip_forward() {
+            while ((this->ptr) && (this->ptr->state != states::END) &&
+                this->ptr->tombstone.load(std::memory_order_relaxed)) plus();
 
-            return tmp;
+            return *this;
         }
 
-        pointer find_max(pointer &node) {
-            pointer tmp = node;
+        AVLiterator& skip_back() {
+            while ((this->ptr) && (this->ptr->state != states::BEGIN) &&
+                this->ptr->tombstone.load(std::memory_order_relaxed)) minus();
+
+            return *this;
+        }
+
+        link find_min(link &node) {
+            link tmp = node;
+            while (tmp->left) tmp = tmp->left;
+
+            return tmp;
+        }
+
+        link find_max(link &node) {
+            link tmp = node;
             while (tmp->right) tmp = tmp->right;
 
             return tmp;
@@ -468,38 +893,414 @@ namespace AVLtree {
         std::shared_mutex *mutex = nullptr;
     };
 
-    template<typename KEY, typename DATA>
+    template<typename KEY, typename DATA, template<typename> class POINTER = IntrusivePointer,
+        typename ALLOC = HeapAllocator>
     class AVL {
+        // an AVL tree of height 128 would need more than 2^88 nodes
+        static const int MAX_HEIGHT = 128;
+
+        // subtrees of other lower than this are not worth a task of their own
+        static const std::size_t PARALLEL_HEIGHT = 12;
+
+        // relaxed writes help rebalancing once more paths than this wait for it
+        static const std::size_t MAX_PENDING = 4096;
+
+        // a lazy erase compacts the tree once more than one node in this many is a tombstone
+        static const std::size_t TOMBSTONE_SHARE = 2;
+
+        template<typename TREE>
+        friend class Transaction;
+
+        template<typename TREE>
+        friend class Combiner;
+
+        template<typename TREE>
+        friend class WriteBatch;
+
     public:
         using key_type = KEY;
         using data_type = DATA;
-        using node_type = Node<key_type, data_type>;
-        using smart_ptr = SmartPointer<node_type>;
-        using iterator = AVLiterator<key_type, data_type>;
+        using node_type = Node<key_type, data_type, POINTER, ALLOC>;
+        using smart_ptr = POINTER<node_type>;
+        using iterator = AVLiterator<key_type, data_type, POINTER, ALLOC>;
         using value_type = std::pair<const key_type, data_type>;
         using size_type = std::size_t;
 
-        AVL() : root(new node_type()), size_(0) {}
+        static_assert(!(smart_ptr::deferred && ALLOC::bulk_release),
+            "nodes retired to the epoch may outlive the tree, they can't live in its arena");
+
+        AVL() : root(create_node()), size_(0), relaxed(false), lazy(false), tombstones(0) {}
 
         ~AVL() {
             std::unique_lock<std::shared_mutex> guard(mutex);
-            this->root->state = states::DESTROY;
+            destroy(typename std::conditional<smart_ptr::deferred, deferred_destroy,
+                std::integral_constant<bool, ALLOC::bulk_release && smart_ptr::detachable &&
+                std::is_trivially_destructible<value_type>::value>>::type());
+        }
+
+        bool insert(const value_type &value) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            return push(value.first, [&] { return create_node(states::VALID, value); }).second;
+        }
+
+        bool insert(value_type &&value) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            return push(value.first, [&] { return create_node(states::VALID, std::move(value)); }).second;
+        }
+
+        // The node is built before the lock is taken, and dropped again if the key is already there.
+        template<typename... ARGS>
+        bool emplace(ARGS&&... args) {
+            node_type *tmp = create_node(states::VALID, std::forward<ARGS>(args)...);
+            bool inserted;
+
+            {
+                std::unique_lock<std::shared_mutex> guard(mutex);
+                inserted = push(tmp->data.first, [&] { return tmp; }).second;
+            }
+
+            if (!inserted) delete tmp;
+
+            return inserted;
+        }
+
+        // Nothing is constructed, and args are left untouched, if key is already there.
+        template<typename... ARGS>
+        bool try_emplace(const key_type &key, ARGS&&... args) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            return push(key, [&] {
+                return create_node(states::VALID, std::piecewise_construct, std::forward_as_tuple(key),
+                    std::forward_as_tuple(std::forward<ARGS>(args)...));
+            }).second;
+        }
+
+        template<typename... ARGS>
+        bool try_emplace(key_type &&key, ARGS&&... args) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            return push(key, [&] {
+                return create_node(states::VALID, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                    std::forward_as_tuple(std::forward<ARGS>(args)...));
+            }).second;
         }
 
-        void insert(const value_type &value) {
+        // Returns true if a new node was linked, false if an existing value was overwritten.
+        template<typename M>
+        bool insert_or_assign(const key_type &key, M &&obj) {
             std::unique_lock<std::shared_mutex> guard(mutex);
-            if (this->root->state == states::FREE) push(this->root, this->root, value);
-            else push(this->root->left, this->root->left, value);
+            std::pair<node_type*, bool> tmp = push(key, [&] {
+                return create_node(states::VALID, key, std::forward<M>(obj));
+            });
+
+            if (!tmp.second) tmp.first->data.second = std::forward<M>(obj);
+
+            return tmp.second;
+        }
+
+        // Loads [first, last), a forward range of pairs, in O(n) plus a sort if the range isn't sorted yet.
+        // Repeated keys keep their first value and keys already in the tree keep theirs, as with insert().
+        // The nodes are built before the lock is taken; under it they are merged with the tree's own and
+        // everything is relinked into a perfectly balanced tree, so readers see all of the input or none.
+        // Returns the number of keys added.
+        template<typename ITER>
+        size_type bulk_load(ITER first, ITER last) {
+            auto less = [](const auto &a, const auto &b) { return a.first < b.first; };
+            std::vector<node_type*> nodes;
+
+            // the slot comes first, so no node is ever built without a place that frees it
+            auto append = [&](ITER it) {
+                if ((nodes.empty()) || (nodes.back()->data.first < it->first)) {
+                    nodes.push_back(nullptr);
+                    nodes.back() = create_node(states::VALID, *it);
+                }
+            };
+
+            // a throwing copy or allocation must not leak the nodes built so far
+            try {
+                if (std::is_sorted(first, last, less)) {
+                    for (ITER it = first; it != last; ++it) append(it);
+                }
+                else {
+                    std::vector<ITER> order;
+                    for (ITER it = first; it != last; ++it) order.push_back(it);
+
+                    // stable, so the first of several equal keys is the one that survives
+                    std::stable_sort(order.begin(), order.end(), [&](const ITER &a, const ITER &b) {
+                        return less(*a, *b);
+                    });
+                    for (ITER it : order) append(it);
+                }
+            }
+            catch (...) {
+                for (node_type *tmp : nodes) {
+                    if (tmp != nullptr) delete tmp;
+                }
+
+                throw;
+            }
+
+            if (nodes.empty()) return 0;
+
+            std::vector<node_type*> dropped;
+            std::vector<smart_ptr> dead;
+            size_type added;
+
+            {
+                std::unique_lock<std::shared_mutex> guard(mutex);
+                purge(dead);
+                added = this->size_;
+                relink(nodes, dropped);
+                added = this->size_ - added;
+            }
+
+            for (node_type *tmp : dropped) delete tmp;
+
+            return added;
+        }
+
+        // Moves every key not below key into right, which must be empty, in O(log n); this tree keeps the
+        // rest. Iterators standing on moved nodes still lock this tree and must not be used any more.
+        void split(const key_type &key, AVL &right) {
+            static_assert(!ALLOC::bulk_release, "nodes can only move to a tree that frees them one by one");
+
+            if (&right == this) throw std::invalid_argument("can't split a tree into itself");
+
+            std::vector<smart_ptr> dead;
+            std::unique_lock<std::shared_mutex> guard(mutex, std::defer_lock);
+            std::unique_lock<std::shared_mutex> right_guard(right.mutex, std::defer_lock);
+            std::lock(guard, right_guard);
+
+            // a tree holding nothing but tombstones is empty
+            right.purge(dead);
+            if (right.root->state != states::FREE) throw std::invalid_argument("split needs an empty tree");
+
+            std::pair<smart_ptr, smart_ptr> tmp = split_nodes(unsettle(), key);
+            size_type count = node_count(tmp.second);
+
+            right.settle(tmp.second, count);
+            settle(tmp.first, this->size_ - count);
+        }
+
+        // Moves every node of right, whose keys must all be above this tree's, to the end of this tree in
+        // O(log n) and leaves right empty. Iterators standing on moved nodes must not be used any more.
+        void join(AVL &right) {
+            static_assert(!ALLOC::bulk_release, "nodes can only move to a tree that frees them one by one");
+
+            if (&right == this) throw std::invalid_argument("can't join a tree with itself");
+
+            std::vector<smart_ptr> dead;
+            std::unique_lock<std::shared_mutex> guard(mutex, std::defer_lock);
+            std::unique_lock<std::shared_mutex> right_guard(right.mutex, std::defer_lock);
+            std::lock(guard, right_guard);
+
+            // the keys compared and the sizes added are those of live nodes only
+            purge(dead);
+            right.purge(dead);
+
+            if (right.root->state == states::FREE) return;
+
+            if ((this->root->state != states::FREE) &&
+                (!(this->sentinel->parent->data.first < right.begin_->data.first))) {
+                throw std::invalid_argument("joined keys must all be above the tree's");
+            }
+
+            size_type count = this->size_ + right.size_;
+            smart_ptr tmp = join_nodes(unsettle(), right.unsettle());
+
+            right.settle(smart_ptr(), 0);
+            settle(tmp, count);
+        }
+
+        // Erases every key in [lo, hi) with two splits and a join instead of one rebalancing erase per key,
+        // returns how many there were. The erased nodes are marked REMOVED and point at the keys around the
+        // range, so an iterator standing on one of them steps out of the range.
+        size_type erase_range(const key_type &lo, const key_type &hi) {
+            if (!(lo < hi)) return 0;
+
+            std::vector<smart_ptr> erased;
+
+            {
+                std::unique_lock<std::shared_mutex> guard(mutex);
+                if (this->root->state == states::FREE) return 0;
+
+                size_type count;
+                smart_ptr range = cut(lo, hi, count);
+                collect(range, erased);
+
+                smart_ptr prev;
+                smart_ptr next = neighbours(lo, prev);
+                for (smart_ptr &node : erased) retire_node(node, prev, next);
+            }
+
+            // whatever no iterator holds is freed here, outside the lock
+            return erased.size();
+        }
+
+        // Moves every key in [lo, hi) into out, which must be empty, with two splits and a join.
+        // Iterators standing on moved nodes must not be used any more.
+        void extract_range(const key_type &lo, const key_type &hi, AVL &out) {
+            static_assert(!ALLOC::bulk_release, "nodes can only move to a tree that frees them one by one");
+
+            if (&out == this) throw std::invalid_argument("can't extract a range into the same tree");
+
+            std::unique_lock<std::shared_mutex> guard(mutex, std::defer_lock);
+            std::unique_lock<std::shared_mutex> out_guard(out.mutex, std::defer_lock);
+            std::lock(guard, out_guard);
+
+            if (out.root->state != states::FREE) throw std::invalid_argument("extract_range needs an empty tree");
+            if ((!(lo < hi)) || (this->root->state == states::FREE)) return;
+
+            size_type count;
+            smart_ptr range = cut(lo, hi, count);
+            out.settle(range, count);
+        }
+
+        // Adds every key of other this tree lacks; keys already here keep their value and other is only read.
+        // Join-based divide and conquer over other's tree: O(m log(n/m + 1)) work for trees of m <= n keys,
+        // and both halves of every large enough subproblem run in parallel on the ThreadPool.
+        // Returns the number of keys added. If a copy throws, the tree keeps all of its own keys and the ones
+        // added so far, and the exception goes on.
+        size_type union_with(AVL &other) {
+            if (&other == this) return 0;
+
+            std::unique_lock<std::shared_mutex> guard(mutex, std::defer_lock);
+            std::shared_lock<std::shared_mutex> other_guard(other.mutex, std::defer_lock);
+            std::lock(guard, other_guard);
+
+            size_type added = 0;
+            Salvage salvage;
+            smart_ptr tmp;
+
+            try {
+                tmp = unite(unsettle(), other.root->left.get(), added, salvage);
+            }
+            catch (...) {
+                restore(salvage);
+                throw;
+            }
+
+            settle(tmp, this->size_ + added);
+
+            return added;
+        }
+
+        // Erases every key other lacks, the same way union_with() adds them; returns how many there were.
+        size_type intersect_with(AVL &other) {
+            if (&other == this) return 0;
+
+            return filter(other, [this](smart_ptr node, node_type *tmp, std::vector<smart_ptr> &erased,
+                Salvage &salvage) {
+                return this->intersect(node, tmp, erased, salvage);
+            });
+        }
+
+        // Erases every key other has, the same way union_with() adds them; returns how many there were.
+        size_type difference_with(AVL &other) {
+            if (&other == this) {
+                std::unique_lock<std::shared_mutex> guard(mutex);
+                smart_ptr tmp = unsettle();
+                size_type count = this->size_;
+
+                std::vector<smart_ptr> erased;
+                try {
+                    collect(tmp, erased);
+                }
+                catch (...) {
+                    settle(tmp, count);
+                    throw;
+                }
+
+                settle(smart_ptr(), 0);
+
+                smart_ptr prev, next;
+                for (smart_ptr &node : erased) retire_node(node, prev, next);
+
+                return count;
+            }
+
+            return filter(other, [this](smart_ptr node, node_type *tmp, std::vector<smart_ptr> &erased,
+                Salvage &salvage) {
+                return this->subtract(node, tmp, erased, salvage);
+            });
         }
 
         void erase(const key_type &key) {
+            if (this->lazy.load(std::memory_order_relaxed)) {
+                bool crowded;
+
+                {
+                    std::shared_lock<std::shared_mutex> guard(mutex);
+                    crowded = bury(key);
+                }
+
+                if (crowded) compact_crowded();
+                return;
+            }
+
             std::unique_lock<std::shared_mutex> guard(mutex);
-            remove(this->root->left, key);
+            if (this->root->state != states::FREE) remove(key);
+        }
+
+        // Lazy erase: erase() only marks the key's node as a tombstone, under the shared lock, so erases run
+        // side by side with each other and with readers and never rotate. Lookups, iterators, ranges, size()
+        // and the snapshots pass tombstones over; an insert of a buried key takes its node out first.
+        // compact() takes them all out in one pass that rebuilds the tree perfectly balanced from the live
+        // nodes, and erase() runs it itself once more than one node in TOMBSTONE_SHARE is buried. The subtree
+        // counts are of live nodes, a lazy erase lowers them on its way up, so rank(), select() and
+        // count_range() stay O(log n). Split, join, the range erases and the set algebra compact first.
+        // Turning it off compacts.
+        void set_lazy_erase(bool on) {
+            std::vector<smart_ptr> dead;
+
+            {
+                std::unique_lock<std::shared_mutex> guard(mutex);
+                this->lazy.store(on, std::memory_order_relaxed);
+
+                if (!on) purge(dead);
+            }
+        }
+
+        // Unlinks every tombstone under one hold of the exclusive lock, returns how many there were.
+        // The nodes are freed outside it, unless an iterator still stands on them.
+        size_type compact() {
+            std::vector<smart_ptr> dead;
+
+            {
+                std::unique_lock<std::shared_mutex> guard(mutex);
+                purge(dead);
+            }
+
+            return dead.size();
+        }
+
+        // Relaxed balancing: an insert or erase only links or unlinks its node and fixes the sizes on its path,
+        // the heights and rotations are left for later and the key is remembered. rebalance_pending() does
+        // that work a few paths at a time, from a maintenance thread or from the writers themselves. A write
+        // also helps when more than MAX_PENDING paths wait, and catches up on all of them when it had to
+        // descend deeper than twice the height of a balanced tree, so no lookup meets a longer path.
+        // Lookups, order statistics and iterators are exact all along; split, join, the range erases and the
+        // set algebra work from heights and catch up first, height() may be stale. Turning it off catches up.
+        void set_relaxed(bool on) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            this->relaxed = on;
+
+            if (!on) repair_paths(this->pending.size());
+        }
+
+        // Rebalances the paths of up to limit relaxed writes under one short hold of the exclusive lock,
+        // returns how many are still waiting.
+        size_type rebalance_pending(size_type limit = 16) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            repair_paths(limit);
+
+            return this->pending.size();
         }
 
         iterator begin() {
             std::shared_lock<std::shared_mutex> guard(mutex);
-            return this->begin_;
+            typename smart_ptr::guard_type epoch;
+            iterator tmp = this->begin_;
+
+            return tmp.skip_forward();
         }
 
         iterator end() {
@@ -509,6 +1310,7 @@ namespace AVLtree {
 
         data_type at(const key_type &key) {
             std::shared_lock<std::shared_mutex> guard(mutex);
+            typename smart_ptr::guard_type epoch;
             smart_ptr tmp = find(key);
 
             if (tmp) return tmp->data.second;
@@ -522,31 +1324,409 @@ namespace AVLtree {
 
         size_type size() {
             std::shared_lock<std::shared_mutex> guard(mutex);
-            return this->size_;
+            return this->size_ - this->tombstones.load(std::memory_order_relaxed);
+        }
+
+        // the first key not below key, or end()
+        iterator lower_bound(const key_type &key) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            smart_ptr tmp = bound(key, false);
+            return make_iterator(tmp);
+        }
+
+        // the first key above key, or end()
+        iterator upper_bound(const key_type &key) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            smart_ptr tmp = bound(key, true);
+            return make_iterator(tmp);
+        }
+
+        std::pair<iterator, iterator> equal_range(const key_type &key) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            smart_ptr first = bound(key, false);
+            smart_ptr last = bound(key, true);
+
+            return std::make_pair(make_iterator(first), make_iterator(last));
+        }
+
+        // Calls fn(pair) for every key in [lo, hi) in order, all under one shared lock. With yield_every set
+        // the lock is given up and taken again after that many pairs, so writers get in on long scans; the
+        // scan then goes on from the first key above the last one it saw. Returns the number of calls.
+        template<typename FN>
+        size_type for_each_in_range(const key_type &lo, const key_type &hi, FN fn, size_type yield_every = 0) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            size_type count = 0;
+
+            if (!(lo < hi)) return 0;
+
+            node_type *node = bound(lo, false).get();
+
+            while ((node != nullptr) && (node->data.first < hi)) {
+                if (node->tombstone.load(std::memory_order_relaxed)) {
+                    node = next_node(node);
+                    continue;
+                }
+
+                const value_type &value = node->data;
+                fn(value);
+                count++;
+
+                if ((yield_every != 0) && (count % yield_every == 0)) {
+                    key_type last = node->data.first;
+
+                    guard.unlock();
+                    guard.lock();
+
+                    node = bound(last, true).get();
+                }
+                else node = next_node(node);
+            }
+
+            return count;
+        }
+
+        // number of keys below key
+        size_type rank(const key_type &key) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            return rank_of(key);
+        }
+
+        // the pair with exactly i keys below it
+        value_type select(size_type i) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+
+            // lazy erases may lower the counts under the descent and run it off the tree: it starts over then
+            while (true) {
+                if (i >= this->size_ - this->tombstones.load(std::memory_order_relaxed))
+                    throw std::out_of_range("index out of range");
+
+                size_type rest = i;
+                node_type *tmp = this->root->left.get();
+
+                while (tmp) {
+                    size_type left = node_count(tmp->left);
+
+                    if (rest < left) tmp = tmp->left.get();
+                    else {
+                        rest -= left;
+                        if (!tmp->tombstone.load(std::memory_order_relaxed)) {
+                            if (rest == 0) return tmp->data;
+                            rest--;
+                        }
+
+                        tmp = tmp->right.get();
+                    }
+                }
+            }
+        }
+
+        // number of keys in [lo, hi)
+        size_type count_range(const key_type &lo, const key_type &hi) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            if (!(lo < hi)) return 0;
+
+            return rank_of(hi) - rank_of(lo);
+        }
+
+        // Copies the tree into a FrozenIndex, which answers at and lower_bound the same way with no locks and
+        // far fewer cache misses. Only the copy is made under the shared lock, the layout is built after it.
+        FrozenIndex<key_type, data_type> freeze() {
+            std::vector<std::pair<key_type, data_type>> sorted;
+
+            {
+                std::shared_lock<std::shared_mutex> guard(mutex);
+                sorted.reserve(this->size_);
+
+                node_type *node = this->root->left.get();
+                while ((node != nullptr) && node->left) node = node->left.get();
+
+                for (; node != nullptr; node = next_node(node)) {
+                    if (!node->tombstone.load(std::memory_order_relaxed))
+                        sorted.emplace_back(node->data.first, node->data.second);
+                }
+            }
+
+            return FrozenIndex<key_type, data_type>(std::move(sorted));
+        }
+
+        // Starts an optimistic transaction over any number of keys, see Transaction. It holds no lock until
+        // its commit, and the tree must outlive it.
+        Transaction<AVL> begin_txn() {
+            return Transaction<AVL>(*this);
+        }
+
+        // Writes the pairs to path in the snapshot format of MappedIndex, under the shared lock.
+        void save(const std::string &path) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            node_type *node = this->root->left.get();
+            while ((node != nullptr) && node->left) node = node->left.get();
+
+            // the header needs the count up front, and lazy erases may bury nodes while the file is written
+            std::vector<node_type*> live;
+            for (; node != nullptr; node = next_node(node)) {
+                if (!node->tombstone.load(std::memory_order_relaxed)) live.push_back(node);
+            }
+
+            MappedIndex<key_type, data_type>::write(path, live.size(), [&live](auto fn) {
+                for (node_type *tmp : live) fn(tmp->data);
+            });
+        }
+
+        // Maps a file written by save() and serves lookups from it without loading anything, see MappedIndex.
+        static MappedIndex<key_type, data_type> open_mmap(const std::string &path) {
+            return MappedIndex<key_type, data_type>(path);
+        }
+
+        // Bytes the nodes take, root and sentinel included, each as the allocator rounds it plus whatever the
+        // pointer policy adds per node. Memory the pairs own themselves, like a string's buffer, isn't counted.
+        // memory_usage() / size() is the cost of one entry.
+        size_type memory_usage() {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            size_type nodes = this->size_ + 1 + (this->sentinel ? 1 : 0);
+
+            return nodes * (ALLOC::footprint(sizeof(node_type)) + smart_ptr::node_overhead());
+        }
+
+        ALLOC& get_allocator() {
+            return this->allocator;
         }
 
         void print(smart_ptr &node) {
             std::shared_lock<std::shared_mutex> guard(mutex);
             if (node) {
                 print(node->left);
-                std::cout << node->data.first << " ";
+                if (!node->tombstone.load(std::memory_order_relaxed)) std::cout << node->data.first << " ";
                 print(node->right);
             }
         }
 
     private:
+        struct deferred_destroy {};
+
+        template<typename... ARGS>
+        node_type* create_node(ARGS&&... args) {
+            void *raw = this->allocator.allocate(sizeof(node_type));
+            node_type *tmp;
+
+            // a placement new that throws doesn't give the memory back by itself
+            try {
+                tmp = new (raw) node_type(std::forward<ARGS>(args)...);
+            }
+            catch (...) {
+                ALLOC::deallocate(raw, sizeof(node_type));
+                throw;
+            }
+
+            smart_ptr::adopt(tmp);
+
+            return tmp;
+        }
+
+        void destroy(std::false_type) {
+            this->root->state = states::DESTROY;
+        }
+
+        // every node lives in the allocator's chunks: forget the handles and give the chunks back at once
+        void destroy(std::true_type) {
+            this->begin_.ptr.forget();
+            this->begin_.end_.forget();
+            this->end_.ptr.forget();
+            this->end_.end_.forget();
+            this->sentinel.forget();
+            this->root.forget();
+            this->allocator.release();
+        }
+
+        // drops the tree's pin on every linked node; whatever is still retired or pinned by an iterator
+        // is freed by whoever lets go of it last
+        void destroy(deferred_destroy) {
+            this->begin_.null_iterator();
+            this->end_.null_iterator();
+
+            std::vector<node_type*> nodes(1, this->root.get());
+            if (this->sentinel) nodes.push_back(this->sentinel.get());
+
+            while (!nodes.empty()) {
+                node_type *tmp = nodes.back();
+                nodes.pop_back();
+
+                if (tmp->left) nodes.push_back(tmp->left.get());
+                if (tmp->right) nodes.push_back(tmp->right.get());
+                smart_ptr::unpin(tmp);
+            }
+        }
+
+        // the first node not below key, or above it if strict
+        smart_ptr bound(const key_type &key, bool strict) {
+            smart_ptr found;
+            smart_ptr *slot = &this->root->left;
+
+            while (*slot) {
+                if (((*slot)->data.first < key) || (strict && (!(key < (*slot)->data.first)))) {
+                    slot = &(*slot)->right;
+                }
+                else {
+                    found = *slot;
+                    slot = &(*slot)->left;
+                }
+            }
+
+            // tombstones are stepped over in order, and the first live node is looked up again for its link
+            if ((found) && found->tombstone.load(std::memory_order_relaxed)) {
+                node_type *node = found.get();
+                while ((node != nullptr) && node->tombstone.load(std::memory_order_relaxed)) node = next_node(node);
+
+                if (node == nullptr) return smart_ptr();
+                return bound(node->data.first, false);
+            }
+
+            return found;
+        }
+
+        iterator make_iterator(smart_ptr &node) {
+            if (!node) return this->end_;
+
+            iterator tmp(node, this->sentinel, &mutex);
+            tmp.state = node->state;
+
+            return tmp;
+        }
+
+        // in-order successor, nullptr after the last node
+        node_type* next_node(node_type *node) {
+            if (node->right) {
+                node = node->right.get();
+                while (node->left) node = node->left.get();
+
+                return node;
+            }
+
+            node_type *parent = node->parent.get();
+            while ((parent != this->root.get()) && (node == parent->right.get())) {
+                node = parent;
+                parent = parent->parent.get();
+            }
+
+            return (parent == this->root.get()) ? nullptr : parent;
+        }
+
+        // every node the search turns right at is below key, and so is its whole left subtree
+        size_type rank_of(const key_type &key) {
+            size_type rank = 0;
+            node_type *tmp = this->root->left.get();
+
+            while (tmp) {
+                if (tmp->data.first < key) {
+                    rank += (tmp->tombstone.load(std::memory_order_relaxed) ? 0 : 1) + node_count(tmp->left);
+                    tmp = tmp->right.get();
+                }
+                else tmp = tmp->left.get();
+            }
+
+            return rank;
+        }
+
         smart_ptr find(const key_type &key) {
             smart_ptr tmp = this->root->left;
 
             while (tmp) {
-                if (key == tmp->data.first) return tmp;
+                if (key == tmp->data.first) return tmp->tombstone.load(std::memory_order_relaxed) ? smart_ptr() : tmp;
                 if (key < tmp->data.first) tmp = tmp->left;
-                if (key > tmp->data.first) tmp = tmp->right;
+                else tmp = tmp->right;
             }
 
             return tmp;
         }
 
+        // for a transaction, a combiner or a write batch, which hold the lock: a lookup, and the writes of
+        // insert, insert_or_assign and erase
+        bool peek(const key_type &key, data_type &value) {
+            typename smart_ptr::guard_type epoch;
+            smart_ptr tmp = find(key);
+
+            if (tmp) value = tmp->data.second;
+            return static_cast<bool>(tmp);
+        }
+
+        bool add(const value_type &value) {
+            return push(value.first, [&] { return create_node(states::VALID, value); }).second;
+        }
+
+        bool store(const key_type &key, const data_type &value) {
+            std::pair<node_type*, bool> tmp = push(key, [&] { return create_node(states::VALID, key, value); });
+            if (!tmp.second) tmp.first->data.second = value;
+
+            return tmp.second;
+        }
+
+        void drop(const key_type &key) {
+            if (this->root->state != states::FREE) remove(key);
+        }
+
+        // A lazy erase, under the shared lock: flips the flag of key's node, which another eraser may be
+        // racing for. Returns true if the tombstones are now due for a compaction.
+        bool bury(const key_type &key) {
+            typename smart_ptr::guard_type epoch;
+            smart_ptr tmp = find(key);
+            bool expected = false;
+
+            if ((!tmp) || (!tmp->tombstone.compare_exchange_strong(expected, true))) return false;
+
+            // the node and everything above it count one live node less
+            for (node_type *node = tmp.get(); node != this->root.get(); node = node->parent.get())
+                node->count.fetch_sub(1, std::memory_order_relaxed);
+
+            this->tombstones.fetch_add(1, std::memory_order_relaxed);
+            return crowded();
+        }
+
+        bool crowded() {
+            return this->tombstones.load(std::memory_order_relaxed) * TOMBSTONE_SHARE > this->size_;
+        }
+
+        // several erasers can find the tombstones due at once, the first one compacts
+        void compact_crowded() {
+            std::vector<smart_ptr> dead;
+
+            {
+                std::unique_lock<std::shared_mutex> guard(mutex);
+                if (crowded()) purge(dead);
+            }
+        }
+
+        // Rebuilds the tree perfectly balanced from its live nodes, like relink(), and retires the tombstones
+        // into dead pointing at the live keys around them, so an iterator standing on one steps back in.
+        // Under the exclusive lock; the caller frees dead, best after letting go of it.
+        void purge(std::vector<smart_ptr> &dead) {
+            if (this->tombstones.load(std::memory_order_relaxed) == 0) return;
+
+            std::vector<smart_ptr> all, live;
+            collect(this->root->left, all);
+            live.reserve(all.size());
+
+            size_type first = dead.size();
+            for (smart_ptr &node : all) {
+                if (node->tombstone.load(std::memory_order_relaxed)) dead.push_back(std::move(node));
+                else live.push_back(std::move(node));
+            }
+
+            smart_ptr top;
+            build(live, 0, live.size(), this->root, top);
+            settle(top, live.size());
+
+            this->tombstones.store(0, std::memory_order_relaxed);
+            this->pending.clear();
+
+            // both runs are in key order, so the live keys around each tombstone come from one merge
+            smart_ptr none;
+            size_type j = 0;
+
+            for (size_type i = first; i < dead.size(); ++i) {
+                while ((j < live.size()) && (live[j]->data.first < dead[i]->data.first)) j++;
+                retire_node(dead[i], (j > 0) ? live[j - 1] : none, (j < live.size()) ? live[j] : this->sentinel);
+            }
+        }
+
         size_type node_height(smart_ptr &node) {
             if (!(node)) return 0;
             return node->height;
@@ -564,11 +1744,18 @@ namespace AVLtree {
             return tmp;
         }
 
-        void init_tree(smart_ptr &node, const value_type &value) {
-            node->left = new node_type(value);
+        smart_ptr find_max(smart_ptr &node) {
+            smart_ptr tmp = node;
+            while (tmp->right) tmp = tmp->right;
+
+            return tmp;
+        }
+
+        void init_tree(smart_ptr &node, node_type *leaf) {
+            node->left = leaf;
             node->left->parent = node;
             node->left->state = states::BEGIN;
-            this->sentinel = new node_type();
+            this->sentinel = create_node();
             this->sentinel->parent = node->left;
             this->sentinel->state = states::END;
 
@@ -584,17 +1771,504 @@ namespace AVLtree {
             this->size_++;
         }
 
-        void link_node(smart_ptr &node, smart_ptr &p, const value_type &value) {
-            node = new node_type(value);
+        // the nodes of node's subtree in key order, each held by a copy of the link that reaches it
+        void collect(smart_ptr &node, std::vector<smart_ptr> &out) {
+            std::vector<smart_ptr*> stack;
+            smart_ptr *slot = &node;
+
+            while ((*slot) || (!stack.empty())) {
+                while (*slot) {
+                    stack.push_back(slot);
+                    slot = &(*slot)->left;
+                }
+
+                slot = stack.back();
+                stack.pop_back();
+                out.push_back(*slot);
+                slot = &(*slot)->right;
+            }
+        }
+
+        // links all[lo, hi) into slot as a perfectly balanced subtree, returns its height
+        size_type build(std::vector<smart_ptr> &all, size_type lo, size_type hi, smart_ptr &parent, smart_ptr &slot) {
+            if (lo == hi) {
+                slot = nullptr;
+                return 0;
+            }
+
+            size_type mid = lo + (hi - lo) / 2;
+            smart_ptr &node = all[mid];
+
+            slot = node;
+            node->parent = parent;
+            node->state = states::VALID;
+
+            build(all, lo, mid, node, node->left);
+            build(all, mid + 1, hi, node, node->right);
+            update_height(node);
+
+            return node->height;
+        }
+
+        // Merges the sorted, key-unique nodes into the tree and rebuilds it from scratch. The old nodes
+        // are reused, so iterators standing on them stay valid; new nodes whose key is already there
+        // go to dropped. Every node is held by all while the links are rewritten.
+        void relink(std::vector<node_type*> &nodes, std::vector<node_type*> &dropped) {
+            std::vector<smart_ptr> old;
+            collect(this->root->left, old);
+
+            std::vector<smart_ptr> all;
+            all.reserve(old.size() + nodes.size());
+
+            size_type i = 0, j = 0;
+            while ((i < old.size()) || (j < nodes.size())) {
+                if ((j == nodes.size()) || ((i < old.size()) && (old[i]->data.first < nodes[j]->data.first)))
+                    all.push_back(old[i++]);
+                else if ((i == old.size()) || (nodes[j]->data.first < old[i]->data.first))
+                    all.push_back(smart_ptr(nodes[j++]));
+                else dropped.push_back(nodes[j++]);
+            }
+
+            smart_ptr top;
+            build(all, 0, all.size(), this->root, top);
+            settle(top, all.size());
+
+            // the rebuild left every height exact
+            this->pending.clear();
+        }
+
+        // Makes node's subtree the whole tree and points begin_, end_ and the sentinel at its ends; an empty
+        // subtree leaves the tree FREE. The old BEGIN node must already be back to VALID.
+        void settle(smart_ptr node, size_type count) {
+            this->size_ = count;
+            this->root->left = node;
+
+            if (!node) {
+                if (this->root->state == states::FREE) return;
+
+                this->begin_.null_iterator();
+                this->end_.null_iterator();
+                smart_ptr::retire(this->sentinel.get());
+                this->sentinel = nullptr;
+                this->root->state = states::FREE;
+
+                return;
+            }
+
+            node->parent = this->root;
+            smart_ptr min = find_min(this->root->left);
+            smart_ptr max = find_max(this->root->left);
+            min->state = states::BEGIN;
+
+            if (this->root->state == states::FREE) {
+                this->sentinel = create_node();
+                this->sentinel->state = states::END;
+
+                this->begin_ = iterator(min, this->sentinel, &mutex);
+                this->end_ = iterator(this->sentinel, this->sentinel, &mutex);
+                this->end_.state = states::END;
+                this->root->state = states::ROOT;
+            }
+
+            this->sentinel->parent = max;
+            this->begin_ = min;
+        }
+
+        // takes the whole tree out, to be put back with settle(); the tombstones go first
+        smart_ptr unsettle() {
+            std::vector<smart_ptr> dead;
+            purge(dead);
+
+            repair_paths(this->pending.size());
+            if (this->root->state == states::FREE) return smart_ptr();
+
+            this->begin_->state = states::VALID;
+            smart_ptr tmp = this->root->left;
+            this->root->left = nullptr;
+
+            return tmp;
+        }
+
+        // Joins left, mid and right, where every key of left is below mid's and every key of right above it,
+        // into one balanced subtree. mid is hung off the spine of the taller side at the first node no more
+        // than one level taller than the other side, and the path above it is retraced like after an insert,
+        // so the cost is the difference in heights. The parent of the returned root is left to the caller.
+        smart_ptr join_nodes(smart_ptr left, smart_ptr mid, smart_ptr right) {
+            size_type left_height = node_height(left);
+            size_type right_height = node_height(right);
+
+            if ((left_height <= right_height + 1) && (right_height <= left_height + 1)) {
+                mid->left = left;
+                mid->right = right;
+                if (left) left->parent = mid;
+                if (right) right->parent = mid;
+                update_height(mid);
+
+                return mid;
+            }
+
+            bool go_right = left_height > right_height;
+            smart_ptr top = go_right ? left : right;
+            size_type other = go_right ? right_height : left_height;
+
+            smart_ptr *path[MAX_HEIGHT];
+            int depth = 0;
+            smart_ptr *slot = &top;
+
+            while (node_height(*slot) > other + 1) {
+                path[depth++] = slot;
+                slot = go_right ? &(*slot)->right : &(*slot)->left;
+            }
+
+            smart_ptr inner = *slot;
+            smart_ptr outer = go_right ? right : left;
+
+            mid->left = go_right ? inner : outer;
+            mid->right = go_right ? outer : inner;
+            if (mid->left) mid->left->parent = mid;
+            if (mid->right) mid->right->parent = mid;
+            update_height(mid);
+
+            mid->parent = *path[depth - 1];
+            *slot = mid;
+            retrace(path, depth);
+
+            return top;
+        }
+
+        // join_nodes() without a middle node: the largest node of left takes that place
+        smart_ptr join_nodes(smart_ptr left, smart_ptr right) {
+            if (!left) return right;
+            if (!right) return left;
+
+            smart_ptr mid;
+            smart_ptr rest = split_last(left, mid);
+
+            return join_nodes(rest, mid, right);
+        }
+
+        // unlinks the largest node of node's subtree into last, returns what is left of the subtree
+        smart_ptr split_last(smart_ptr node, smart_ptr &last) {
+            if (!(node->right)) {
+                last = node;
+                return node->left;
+            }
+
+            smart_ptr rest = split_last(node->right, last);
+            return join_nodes(node->left, node, rest);
+        }
+
+        // Splits node's subtree into the keys below key and the rest. Every node on the search path is
+        // joined back with the side subtree it leaves behind, and the heights along the way telescope,
+        // so the whole split costs O(log n). Given found, the node holding key is left out and put there.
+        std::pair<smart_ptr, smart_ptr> split_nodes(smart_ptr node, const key_type &key, smart_ptr *found = nullptr) {
+            if (!node) return std::make_pair(smart_ptr(), smart_ptr());
+
+            smart_ptr left = node->left;
+            smart_ptr right = node->right;
+
+            if ((found != nullptr) && (key == node->data.first)) {
+                *found = node;
+                return std::make_pair(left, right);
+            }
+
+            if (node->data.first < key) {
+                std::pair<smart_ptr, smart_ptr> tmp = split_nodes(std::move(right), key, found);
+                return std::make_pair(join_nodes(std::move(left), std::move(node), std::move(tmp.first)),
+                    std::move(tmp.second));
+            }
+
+            std::pair<smart_ptr, smart_ptr> tmp = split_nodes(std::move(left), key, found);
+            return std::make_pair(std::move(tmp.first),
+                join_nodes(std::move(tmp.second), std::move(node), std::move(right)));
+        }
+
+        // the last node below key, or none, and the first one not below it, or the sentinel
+        smart_ptr neighbours(const key_type &key, smart_ptr &prev) {
+            smart_ptr next = this->sentinel;
+            smart_ptr *slot = &this->root->left;
+
+            while (*slot) {
+                if ((*slot)->data.first < key) {
+                    prev = *slot;
+                    slot = &(*slot)->right;
+                }
+                else {
+                    next = *slot;
+                    slot = &(*slot)->left;
+                }
+            }
+
+            return next;
+        }
+
+        // A node erased without remove() still points at the keys around it, so an iterator standing on it
+        // can step back into the tree.
+        void retire_node(smart_ptr &node, smart_ptr &prev, smart_ptr &next) {
+            node->parent = nullptr;
+            node->left = prev;
+            node->right = next;
+            node->state = states::REMOVED;
+            smart_ptr::retire(node.get());
+        }
+
+        // What a set operation that threw still holds of the tree: whole subtrees, and single nodes it had
+        // already taken out. Both halves of a fork may add to it at once.
+        struct Salvage {
+            std::mutex mutex;
+            std::vector<smart_ptr> trees;
+            std::vector<smart_ptr> nodes;
+
+            void keep(smart_ptr &node) {
+                if (!node) return;
+
+                std::lock_guard<std::mutex> guard(this->mutex);
+                this->trees.push_back(std::move(node));
+            }
+
+            void keep(std::vector<smart_ptr> &taken) {
+                std::lock_guard<std::mutex> guard(this->mutex);
+                this->nodes.insert(this->nodes.end(), taken.begin(), taken.end());
+            }
+        };
+
+        // Puts everything a failed set operation held back together as the whole tree. A node can be both in
+        // a subtree and taken out, so the keys are made unique again.
+        void restore(Salvage &salvage) {
+            std::vector<smart_ptr> all;
+            for (smart_ptr &tmp : salvage.trees) collect(tmp, all);
+            all.insert(all.end(), salvage.nodes.begin(), salvage.nodes.end());
+
+            std::sort(all.begin(), all.end(), [](const smart_ptr &a, const smart_ptr &b) {
+                return a->data.first < b->data.first;
+            });
+            all.erase(std::unique(all.begin(), all.end(), [](const smart_ptr &a, const smart_ptr &b) {
+                return !(a->data.first < b->data.first);
+            }), all.end());
+
+            smart_ptr top;
+            build(all, 0, all.size(), this->root, top);
+            settle(top, all.size());
+        }
+
+        // runs both halves, on two threads when the subproblem is big enough to pay for a task
+        template<typename LEFT, typename RIGHT>
+        static void fork(node_type *other, LEFT &&left, RIGHT &&right) {
+            if (other->height >= PARALLEL_HEIGHT) ThreadPool::instance().invoke(left, right);
+            else {
+                left();
+                right();
+            }
+        }
+
+        // A copy of other's subtree, built from this tree's allocator. It has the same shape unless other holds
+        // tombstones, which are left out and their halves joined without them. The copies made before one
+        // throws go to salvage like the tree's own nodes.
+        smart_ptr copy(node_type *other, size_type &added, Salvage &salvage) {
+            if (other == nullptr) return smart_ptr();
+
+            smart_ptr left, right, node;
+            size_type right_added = 0;
+
+            try {
+                fork(other, [&] { left = copy(other->left.get(), added, salvage); },
+                    [&] { right = copy(other->right.get(), right_added, salvage); });
+
+                if (!other->tombstone.load(std::memory_order_relaxed)) node = create_node(states::VALID, other->data);
+            }
+            catch (...) {
+                salvage.keep(left);
+                salvage.keep(right);
+                throw;
+            }
+
+            added += right_added;
+            if (!node) return join_nodes(std::move(left), std::move(right));
+
+            added++;
+            return join_nodes(std::move(left), std::move(node), std::move(right));
+        }
+
+        // The divide and conquer behind the set operations: split node's subtree by the key at other's root,
+        // solve both sides against other's children, and join the results around the root key if it stays.
+        // Subproblems share no node of this tree, and other is only read, so they need no locking.
+        // If a copy throws, every level hands what it holds of this tree to salvage on the way out.
+        smart_ptr unite(smart_ptr node, node_type *other, size_type &added, Salvage &salvage) {
+            if (other == nullptr) return node;
+            if (!node) return copy(other, added, salvage);
+
+            smart_ptr found;
+            std::pair<smart_ptr, smart_ptr> parts = split_nodes(std::move(node), other->data.first, &found);
+            smart_ptr left, right;
+            size_type right_added = 0;
+
+            try {
+                fork(other, [&] { left = unite(std::move(parts.first), other->left.get(), added, salvage); },
+                    [&] { right = unite(std::move(parts.second), other->right.get(), right_added, salvage); });
+
+                if ((!found) && (!other->tombstone.load(std::memory_order_relaxed))) {
+                    found = create_node(states::VALID, other->data);
+                    added++;
+                }
+            }
+            catch (...) {
+                added += right_added;
+                salvage.keep(parts.first);
+                salvage.keep(parts.second);
+                salvage.keep(left);
+                salvage.keep(right);
+                salvage.keep(found);
+                throw;
+            }
+
+            added += right_added;
+            if (!found) return join_nodes(std::move(left), std::move(right));
+
+            return join_nodes(std::move(left), std::move(found), std::move(right));
+        }
+
+        smart_ptr intersect(smart_ptr node, node_type *other, std::vector<smart_ptr> &erased, Salvage &salvage) {
+            if (!node) return node;
+
+            if (other == nullptr) {
+                try {
+                    collect(node, erased);
+                }
+                catch (...) {
+                    salvage.keep(node);
+                    throw;
+                }
+
+                return smart_ptr();
+            }
+
+            smart_ptr found;
+            std::pair<smart_ptr, smart_ptr> parts = split_nodes(std::move(node), other->data.first, &found);
+            smart_ptr left, right;
+            std::vector<smart_ptr> right_erased;
+
+            try {
+                fork(other, [&] { left = intersect(std::move(parts.first), other->left.get(), erased, salvage); },
+                    [&] { right = intersect(std::move(parts.second), other->right.get(), right_erased, salvage); });
+
+                erased.insert(erased.end(), right_erased.begin(), right_erased.end());
+            }
+            catch (...) {
+                salvage.keep(parts.first);
+                salvage.keep(parts.second);
+                salvage.keep(left);
+                salvage.keep(right);
+                salvage.keep(found);
+                salvage.keep(right_erased);
+                throw;
+            }
+
+            // other's tombstone doesn't keep the key
+            if (found) {
+                if (!other->tombstone.load(std::memory_order_relaxed))
+                    return join_nodes(std::move(left), std::move(found), std::move(right));
+
+                erased.push_back(found);
+            }
+
+            return join_nodes(std::move(left), std::move(right));
+        }
+
+        smart_ptr subtract(smart_ptr node, node_type *other, std::vector<smart_ptr> &erased, Salvage &salvage) {
+            if ((!node) || (other == nullptr)) return node;
+
+            smart_ptr found;
+            std::pair<smart_ptr, smart_ptr> parts = split_nodes(std::move(node), other->data.first, &found);
+            smart_ptr left, right;
+            std::vector<smart_ptr> right_erased;
+
+            try {
+                fork(other, [&] { left = subtract(std::move(parts.first), other->left.get(), erased, salvage); },
+                    [&] { right = subtract(std::move(parts.second), other->right.get(), right_erased, salvage); });
+
+                erased.insert(erased.end(), right_erased.begin(), right_erased.end());
+            }
+            catch (...) {
+                salvage.keep(parts.first);
+                salvage.keep(parts.second);
+                salvage.keep(left);
+                salvage.keep(right);
+                salvage.keep(found);
+                salvage.keep(right_erased);
+                throw;
+            }
+
+            // nor does it take the key out
+            if (found) {
+                if (other->tombstone.load(std::memory_order_relaxed))
+                    return join_nodes(std::move(left), std::move(found), std::move(right));
+
+                erased.push_back(found);
+            }
+
+            return join_nodes(std::move(left), std::move(right));
+        }
+
+        // runs intersect() or subtract() against other and retires what they take out
+        template<typename STEP>
+        size_type filter(AVL &other, STEP step) {
+            std::vector<smart_ptr> erased;
+
+            {
+                std::unique_lock<std::shared_mutex> guard(mutex, std::defer_lock);
+                std::shared_lock<std::shared_mutex> other_guard(other.mutex, std::defer_lock);
+                std::lock(guard, other_guard);
+
+                if (this->root->state == states::FREE) return 0;
+
+                Salvage salvage;
+                smart_ptr tmp;
+
+                // nothing is erased unless all of it is
+                try {
+                    tmp = step(unsettle(), other.root->left.get(), erased, salvage);
+                }
+                catch (...) {
+                    salvage.keep(erased);
+                    restore(salvage);
+                    throw;
+                }
+
+                settle(tmp, this->size_ - erased.size());
+
+                for (smart_ptr &node : erased) {
+                    smart_ptr prev;
+                    smart_ptr next = neighbours(node->data.first, prev);
+                    retire_node(node, prev, next);
+                }
+            }
+
+            // whatever no iterator holds is freed here, outside the lock
+            return erased.size();
+        }
+
+        // takes the subtree of keys in [lo, hi) out of the tree, joining what is left around it
+        smart_ptr cut(const key_type &lo, const key_type &hi, size_type &count) {
+            std::pair<smart_ptr, smart_ptr> low = split_nodes(unsettle(), lo);
+            std::pair<smart_ptr, smart_ptr> high = split_nodes(low.second, hi);
+            count = node_count(high.first);
+
+            settle(join_nodes(low.first, high.second), this->size_ - count);
+
+            return high.first;
+        }
+
+        void link_node(smart_ptr &node, smart_ptr &p, node_type *leaf) {
+            node = leaf;
             node->parent = p;
 
-            if ((value.first < p->data.first) && (p->state == BEGIN)) {
+            if ((node->data.first < p->data.first) && (p->state == BEGIN)) {
                 p->state = VALID;
                 node->state = BEGIN;
                 this->begin_ = node;
             }
 
-            if ((value.first > p->data.first) && (p == this->sentinel->parent)) {
+            if ((node->data.first > p->data.first) && (p == this->sentinel->parent)) {
                 this->sentinel->parent = node;
                 this->sentinel->state = END;
             }
@@ -602,210 +2276,301 @@ namespace AVLtree {
             this->size_++;
         }
 
-        void nodes_correction(smart_ptr &x, smart_ptr &y, smart_ptr &z, bool flag) {
-            smart_ptr tmp = x;
-            if (z) z->parent = x;
+        size_type node_count(const smart_ptr &node) {
+            if (!(node)) return 0;
+            return node->count.load(std::memory_order_relaxed);
+        }
+
+        void update_count(smart_ptr &node) {
+            size_type self = node->tombstone.load(std::memory_order_relaxed) ? 0 : 1;
+            node->count.store(self + node_count(node->left) + node_count(node->right), std::memory_order_relaxed);
+        }
+
+        void update_height(smart_ptr &node) {
+            node->height = static_cast<typename node_type::height_type>(1 + compare(node_height(node->left),
+                node_height(node->right)));
+            update_count(node);
+        }
+
+        void right_rotation(smart_ptr &slot) {
+            smart_ptr x = slot;
+            smart_ptr y = x->left;
+
+            x->left = y->right;
+            if (x->left) x->left->parent = x;
+
+            y->parent = x->parent;
+            slot = y;
+            y->right = x;
+            x->parent = y;
+
+            update_height(x);
+            update_height(y);
+        }
+
+        void left_rotation(smart_ptr &slot) {
+            smart_ptr x = slot;
+            smart_ptr y = x->right;
+
+            x->right = y->left;
+            if (x->right) x->right->parent = x;
 
-            if (x->parent->state == states::ROOT) x->parent->left = y;
+            y->parent = x->parent;
+            slot = y;
+            y->left = x;
+            x->parent = y;
 
-            y->parent = tmp->parent;
-            tmp->parent = y;
+            update_height(x);
+            update_height(y);
+        }
+
+        void rebalance(smart_ptr &slot) {
+            int balance = get_balance(slot);
 
-            if (flag) {
-                tmp->left = z;
-                y->right = tmp;
+            if (balance > 1) {
+                if (get_balance(slot->left) < 0) left_rotation(slot->left);
+                right_rotation(slot);
             }
-            else {
-                tmp->right = z;
-                y->left = tmp;
+            else if (balance < -1) {
+                if (get_balance(slot->right) > 0) right_rotation(slot->right);
+                left_rotation(slot);
             }
-
-            tmp->height = (1 + compare(node_height(tmp->left), node_height(tmp->right)));
-            y->height = (1 + compare(node_height(y->left), node_height(y->right)));
         }
 
-        smart_ptr& right_rotation(smart_ptr &node) {
-            smart_ptr tmp_1 = node->left;
-            smart_ptr tmp_2 = tmp_1->right;
+        // Walks the recorded path bottom-up and stops rebalancing at the first subtree whose height didn't
+        // change, nothing above it can be out of balance. Every subtree above still changed its size.
+        void retrace(smart_ptr **path, int depth) {
+            int i = depth - 1;
 
-            nodes_correction(node, tmp_1, tmp_2, true);
+            for (; i >= 0; --i) {
+                smart_ptr &slot = *path[i];
+                size_type old_height = slot->height;
+
+                update_height(slot);
+                rebalance(slot);
+
+                if (slot->height == old_height) {
+                    --i;
+                    break;
+                }
+            }
 
-            return node;
+            for (; i >= 0; --i) update_count(*path[i]);
         }
 
-        smart_ptr& left_rotation(smart_ptr &node) {
-            smart_ptr tmp_1 = node->right;
-            smart_ptr tmp_2 = tmp_1->left;
+        // Relaxed counterpart of retrace(): keeps the sizes exact and remembers the deepest node whose height
+        // may be off, every node above it on the path is then off at most as much.
+        void defer(smart_ptr **path, int depth) {
+            for (int i = depth - 1; i >= 0; --i) update_count(*path[i]);
+            if (depth == 0) return;
 
-            nodes_correction(node, tmp_1, tmp_2, false);
+            this->pending.push_back((*path[depth - 1])->data.first);
 
-            return node;
+            size_type bound = 2;
+            for (size_type tmp = this->size_ + 1; tmp > 1; tmp >>= 1) bound += 2;
+
+            if (static_cast<size_type>(depth) > bound) repair_paths(this->pending.size());
+            else if (this->pending.size() > MAX_PENDING) repair_paths(2);
         }
 
-        smart_ptr& push(smart_ptr &node, smart_ptr &p, const value_type &value) {
-            if ((p->state == states::FREE) || (!(node))) {
-                if (p->state == states::FREE) {
-                    init_tree(node, value);
-                    node->state = states::ROOT;
-                    return node;
-                }
+        // Retraces the paths of the latest limit relaxed writes. A node's height may be off only if it lies
+        // above a pending key, and rotations keep it that way, so once every path is done all heights are
+        // exact again and every node balanced.
+        void repair_paths(size_type limit) {
+            for (; (limit > 0) && (!this->pending.empty()); --limit) {
+                key_type key = std::move(this->pending.back());
+                this->pending.pop_back();
 
-                link_node(node, p, value);
-                return node;
+                if (this->root->state != states::FREE) repair(key);
             }
+        }
 
-            if (value.first < node->data.first) {
-                smart_ptr tmp = push(node->left, node, value);
-                node->left = tmp;
-            }
-            else if (value.first > node->data.first) {
-                smart_ptr tmp = push(node->right, node, value);
-                node->right = tmp;
-            }
-            else return node;
+        // Unlike retrace(), never stops early, and mends the imbalance of several relaxed writes: one
+        // rotation when the heights differ by two, a perfectly balanced rebuild of the subtree beyond that.
+        void repair(const key_type &key) {
+            smart_ptr *path[MAX_HEIGHT];
+            int depth = 0;
+            smart_ptr *slot = &this->root->left;
 
-            node->height = (1 + compare(node_height(node->left), node_height(node->right)));
-            int balance = get_balance(node);
+            while (*slot) {
+                path[depth++] = slot;
 
-            if ((balance < -1) && (value.first > node->right->data.first))
-                return left_rotation(node)->parent;
-            if ((balance < -1) && (value.first < node->right->data.first)) {
-                node->right = right_rotation(node->right)->parent;
-                return left_rotation(node)->parent;
+                if (key < (*slot)->data.first) slot = &(*slot)->left;
+                else if ((*slot)->data.first < key) slot = &(*slot)->right;
+                else break;
             }
 
-            if ((balance > 1) && (value.first < node->left->data.first))
-                return right_rotation(node)->parent;
-            if ((balance > 1) && (value.first > node->left->data.first)) {
-                node->left = left_rotation(node->left)->parent;
-                return right_rotation(node)->parent;
+            for (int i = depth - 1; i >= 0; --i) {
+                smart_ptr &node = *path[i];
+                update_height(node);
+
+                int balance = get_balance(node);
+                if ((balance >= -1) && (balance <= 1)) continue;
+
+                if ((balance == 2) || (balance == -2)) {
+                    rebalance(node);
+                    if (balanced(node) && balanced(node->left) && balanced(node->right)) continue;
+                }
+
+                rebuild(node);
             }
+        }
 
-            return node;
+        bool balanced(smart_ptr &node) {
+            if (!(node)) return true;
+
+            int balance = get_balance(node);
+            return (balance >= -1) && (balance <= 1);
         }
 
-        smart_ptr& remove(smart_ptr &node, const key_type &key) {
-            if (!(node)) return node;
+        // relinks the subtree as perfectly balanced as build() makes the whole tree
+        void rebuild(smart_ptr &slot) {
+            std::vector<smart_ptr> nodes;
+            collect(slot, nodes);
 
-            if (node->data.first > key) {
-                smart_ptr tmp = remove(node->left, key);
-                node->left = tmp;
+            // build() marks every node VALID, the tree's first one has to stay BEGIN
+            states first = nodes.front()->state;
+            smart_ptr parent = slot->parent;
+
+            build(nodes, 0, nodes.size(), parent, slot);
+            nodes.front()->state = first;
+        }
 
+        // path holds the parent links on the way down, not the nodes, so descending costs no reference
+        // counting and a rotation just rewrites the link it is handed.
+        // make() is only called once key is known to be absent; returns the node holding key and
+        // whether it is the new one.
+        template<typename MAKE>
+        std::pair<node_type*, bool> push(const key_type &key, MAKE make) {
+            if (this->root->state == states::FREE) {
+                node_type *leaf = make();
+                init_tree(this->root, leaf);
+                this->root->state = states::ROOT;
+
+                return std::make_pair(leaf, true);
             }
-            else if (node->data.first < key) {
-                smart_ptr tmp = remove(node->right, key);
-                node->right = tmp;
+
+            smart_ptr *path[MAX_HEIGHT];
+            int depth = 0;
+            smart_ptr *slot = &this->root->left;
+
+            while (*slot) {
+                node_type *node = slot->get();
+                path[depth++] = slot;
+
+                if (key < node->data.first) slot = &node->left;
+                else if (key > node->data.first) slot = &node->right;
+                else if (!node->tombstone.load(std::memory_order_relaxed)) return std::make_pair(node, false);
+                else {
+                    // a buried key comes back as a new node, the tombstone goes the ordinary way
+                    remove(key);
+                    return push(key, make);
+                }
             }
-            else {
-                if ((!(node->left)) || (!(node->right))) {
-                    smart_ptr tmp = node->left ? node->left : node->right;
-
-                    if (!(tmp)) {
-                        if (node->state == states::BEGIN) {
-                            if (node->parent->state != states::ROOT) {
-                                node->parent->state = states::BEGIN;
-                                node->state = states::VALID;
-                                this->begin_ = node->parent;
-                            }
-                            else {
-                                this->begin_.null_iterator();
-                            }
-                        }
 
-                        if (this->sentinel->parent == node) {
-                            if (this->size_ == 1) {
-                                this->end_.null_iterator();
-                                this->sentinel = nullptr;
-                                this->root->state = states::FREE;
-                            }
-                            else {
-                                this->sentinel->parent = node->parent;
-                            }
-                        }
+            node_type *leaf = make();
+            link_node(*slot, *path[depth - 1], leaf);
 
-                        if (node.get_core()->ref_count > 1) node->state = states::REMOVED;
-                        if (node->parent->right == node) node->parent->right = nullptr;
-                        else if (node->parent->left == node) node->parent->left = nullptr;
+            if (this->relaxed) defer(path, depth);
+            else retrace(path, depth);
 
-                        this->size_--;
+            return std::make_pair(leaf, true);
+        }
 
-                        return node;
-                    }
-                    else {
-                        if (node->state == states::BEGIN) {
-                            if (node->parent->state != states::ROOT) {
-                                node->parent->state = states::BEGIN;
-                                node->state = states::VALID;
-                                this->begin_ = node->parent;
-                            }
-                            else {
-                                this->begin_ = node->right;
-                            }
-                        }
+        void remove(const key_type &key) {
+            smart_ptr *path[MAX_HEIGHT];
+            int depth = 0;
+            smart_ptr *slot = &this->root->left;
 
-                        if (this->sentinel->parent == node) this->sentinel->parent = tmp;
+            while ((*slot) && ((*slot)->data.first != key)) {
+                path[depth++] = slot;
 
-                        tmp->parent = node->parent;
-                        if (node.get_core()->ref_count > 1) node->state = states::REMOVED;
-                        if (node->parent->right == node) node->parent->right = tmp;
-                        else if (node->parent->left == node) node->parent->left = tmp;
+                if (key < (*slot)->data.first) slot = &(*slot)->left;
+                else slot = &(*slot)->right;
+            }
 
-                        this->size_--;
+            if (!(*slot)) return;
 
-                        return node;
-                    }
+            smart_ptr node = *slot;
+
+            if ((!(node->left)) || (!(node->right))) {
+                smart_ptr tmp = node->left ? node->left : node->right;
+
+                if (this->size_ == 1) {
+                    this->begin_.null_iterator();
+                    this->end_.null_iterator();
+                    smart_ptr::retire(this->sentinel.get());
+                    this->sentinel = nullptr;
+                    this->root->state = states::FREE;
                 }
                 else {
-                    smart_ptr tmp = find_min(node->right);
-                    if (tmp != node->right) node->right = remove(node->right, tmp->data.first);
-                    smart_ptr node_ = tmp;
-
-                    if (node_->state == states::REMOVED) node_->state = states::VALID;
-                    if (this->sentinel->parent == node) this->sentinel->parent = node_;
-
-                    if (tmp != node->right) {
-                        node_->right = node->right;
-                        if (node_->right) node_->right->parent = node_;
-                        node_->left = node->left;
-                        if (node_->left) node_->left->parent = node_;
-                    }
-                    else {
-                        node_->left = node->left;
-                        if (node_->left) node_->left->parent = node_;
+                    if (node->state == states::BEGIN) {
+                        smart_ptr next = tmp ? find_min(tmp) : node->parent;
+                        next->state = states::BEGIN;
+                        this->begin_ = next;
                     }
 
-                    node_->parent = node->parent;
-                    if (node.get_core()->ref_count > 1) node->state = states::REMOVED;
-                    if (node->parent->right == node) node->parent->right = node_;
-                    else if (node->parent->left == node) node->parent->left = node_;
-
-                    return node;
+                    if (this->sentinel->parent == node) this->sentinel->parent = tmp ? find_max(tmp) : node->parent;
                 }
+
+                if (tmp) tmp->parent = node->parent;
+                *slot = tmp;
             }
+            else {
+                int index = depth;
+                path[depth++] = slot;
 
-            node->height = (1 + compare(node_height(node->left), node_height(node->right)));
-            int balance = get_balance(node);
+                smart_ptr *next_slot = &node->right;
+                while ((*next_slot)->left) {
+                    path[depth++] = next_slot;
+                    next_slot = &(*next_slot)->left;
+                }
 
-            if ((balance > 1) && (get_balance(node->left) >= 0)) return right_rotation(node)->parent;
-            if ((balance > 1) && (get_balance(node->left) < 0)) {
-                node->left = left_rotation(node->left)->parent;
-                return right_rotation(node)->parent;
-            }
+                smart_ptr next = *next_slot;
 
-            if ((balance < -1) && (get_balance(node->right) <= 0)) return left_rotation(node)->parent;
-            if ((balance < -1) && (get_balance(node->right) > 0)) {
-                node->right = right_rotation(node->right)->parent;
-                return left_rotation(node)->parent;
+                if (next->right) next->right->parent = next->parent;
+                *next_slot = next->right;
+
+                next->left = node->left;
+                next->right = node->right;
+                if (next->left) next->left->parent = next;
+                if (next->right) next->right->parent = next;
+
+                next->parent = node->parent;
+                next->height = node->height;
+                *slot = next;
+
+                // an iterator still standing on the removed node steps right, straight onto its successor
+                node->right = next;
+
+                if (depth > index + 1) path[index + 1] = &next->right;
             }
 
-            return node;
+            node->state = states::REMOVED;
+            smart_ptr::retire(node.get());
+            this->size_--;
+            if (node->tombstone.load(std::memory_order_relaxed))
+                this->tombstones.fetch_sub(1, std::memory_order_relaxed);
+
+            if (this->relaxed) defer(path, depth);
+            else retrace(path, depth);
         }
 
+        ALLOC allocator;
         std::shared_mutex mutex;
         smart_ptr root;
         smart_ptr sentinel;
         iterator begin_;
         iterator end_;
         size_type size_;
+
+        bool relaxed;
+        // keys of the relaxed writes whose paths still wait for their heights and rotations
+        std::vector<key_type> pending;
+
+        // read by erase() before it picks its lock, so set under the exclusive lock but atomic
+        std::atomic<bool> lazy;
+        // nodes buried by lazy erases, still linked in and counted by size_; raised under the shared lock
+        std::atomic<size_type> tombstones;
     };
 }
\ No newline at end of file
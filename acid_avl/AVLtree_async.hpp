@@ -0,0 +1,340 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <stdexcept>
+#include "AVLtree.hpp"
+
+namespace AVLtreeAsync {
+    // Write-behind front-end for an AVL tree. A write is only pushed onto a lock-free queue, many producers
+    // and one consumer, and the call returns; a background applier drains the queue and applies what it
+    // got as one WriteBatch, sorted by key and under one acquisition of the tree's lock. Writes of one thread
+    // reach the tree in the order it made them. sync() returns a future that is ready once every write
+    // submitted before it, by any thread, is in the tree, and flush() waits for it.
+    // at() sees the calling thread's own writes still in the queue, other threads' ones only once applied.
+    // Each thread keeps its queued writes in a log of its own, dropped as the applier catches up.
+    template<typename KEY, typename DATA, template<typename> class POINTER = AVLtree::IntrusivePointer,
+        typename ALLOC = AVLtree::HeapAllocator>
+    class AsyncAVL {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using tree_type = AVLtree::AVL<key_type, data_type, POINTER, ALLOC>;
+        using value_type = std::pair<const key_type, data_type>;
+        using size_type = std::size_t;
+
+        AsyncAVL() : head(&stub), tail(&stub), sleeping(false), stop(false), id(next_id()) {
+            this->applier = std::thread(&AsyncAVL::run, this);
+        }
+
+        AsyncAVL(const AsyncAVL &) = delete;
+        AsyncAVL &operator=(const AsyncAVL &) = delete;
+
+        // everything submitted is applied first, no producer may be running any more
+        ~AsyncAVL() {
+            {
+                std::lock_guard<std::mutex> guard(this->sleep_mutex);
+                this->stop = true;
+            }
+
+            this->wake.notify_one();
+            this->applier.join();
+        }
+
+        // adds key only if it isn't there when the write is applied
+        void insert(const value_type &value) {
+            submit(INSERT, value.first, value.second);
+        }
+
+        void insert_or_assign(const key_type &key, const data_type &obj) {
+            submit(ASSIGN, key, obj);
+        }
+
+        void erase(const key_type &key) {
+            submit(ERASE, key, data_type());
+        }
+
+        std::future<void> sync() {
+            Op *op = new Op();
+            op->op = FENCE;
+            op->fence.reset(new std::promise<void>());
+
+            std::future<void> tmp = op->fence->get_future();
+            enqueue(op);
+
+            return tmp;
+        }
+
+        void flush() {
+            sync().wait();
+        }
+
+        // the tree's value, unless this thread has queued writes to key that aren't applied yet
+        data_type at(const key_type &key) {
+            Producer &self = producer();
+            self.prune();
+
+            bool known = false, present = false;
+            data_type value = data_type();
+
+            for (size_type i = self.first; i < self.pending.size(); ++i) {
+                const Pending &tmp = self.pending[i];
+                if (!(tmp.key == key)) continue;
+
+                if (tmp.op == ASSIGN) {
+                    known = present = true;
+                    value = tmp.value;
+                }
+                else if (tmp.op == ERASE) {
+                    known = true;
+                    present = false;
+                }
+                else {
+                    // an insert only lands if key is absent by then
+                    if (!known) {
+                        known = true;
+                        present = lookup(key, value);
+                    }
+
+                    if (!present) {
+                        present = true;
+                        value = tmp.value;
+                    }
+                }
+            }
+
+            if (!known) return this->tree_.at(key);
+            if (!present) throw std::out_of_range("key out of range");
+
+            return value;
+        }
+
+        // applied writes only
+        size_type size() {
+            return this->tree_.size();
+        }
+
+        // writes made straight to it bypass the queue, and may overtake queued ones
+        tree_type& tree() {
+            return this->tree_;
+        }
+
+    private:
+        // a batch is applied at the latest after this many writes, so threads waiting in sync() see progress
+        static const size_type MAX_BATCH = 4096;
+
+        enum ops : unsigned char { INSERT, ASSIGN, ERASE, FENCE };
+
+        struct Pending {
+            key_type key;
+            data_type value;
+            ops op;
+            std::uint64_t seq;
+        };
+
+        // A thread's view of its own writes. Only the thread touches pending and submitted, the applier only
+        // raises applied, to the seq of the last of its writes that is in the tree.
+        struct Producer {
+            Producer() : applied(0), submitted(0), first(0) {}
+
+            // forgets the writes the tree already has
+            void prune() {
+                std::uint64_t done = this->applied.load(std::memory_order_acquire);
+                while ((this->first < this->pending.size()) && (this->pending[this->first].seq <= done)) this->first++;
+
+                if (this->first == this->pending.size()) {
+                    this->pending.clear();
+                    this->first = 0;
+                }
+                else if ((this->first > 1024) && (2 * this->first > this->pending.size())) {
+                    this->pending.erase(this->pending.begin(), this->pending.begin() + this->first);
+                    this->first = 0;
+                }
+            }
+
+            std::atomic<std::uint64_t> applied;
+            std::uint64_t submitted;
+            std::vector<Pending> pending;
+            size_type first;
+        };
+
+        struct Op {
+            Op() : producer(nullptr), seq(0) {
+                this->next.store(nullptr, std::memory_order_relaxed);
+            }
+
+            std::atomic<Op*> next;
+            key_type key;
+            data_type value;
+            ops op;
+            Producer *producer;
+            std::uint64_t seq;
+            std::unique_ptr<std::promise<void>> fence;
+        };
+
+        static std::uint64_t next_id() {
+            static std::atomic<std::uint64_t> ids(0);
+            return ++ids;
+        }
+
+        // Every thread remembers its record by the map's id, not its address: a new map at the address of a
+        // dead one must not find the old record. Those of dead maps just stay, one pair each.
+        Producer& producer() {
+            thread_local std::vector<std::pair<std::uint64_t, Producer*>> mine;
+            for (auto &tmp : mine) {
+                if (tmp.first == this->id) return *tmp.second;
+            }
+
+            std::lock_guard<std::mutex> guard(this->producers_mutex);
+            this->producers.emplace_back(new Producer());
+            mine.emplace_back(this->id, this->producers.back().get());
+
+            return *this->producers.back();
+        }
+
+        bool lookup(const key_type &key, data_type &value) {
+            try {
+                value = this->tree_.at(key);
+                return true;
+            }
+            catch (const std::out_of_range &) {
+                return false;
+            }
+        }
+
+        void submit(ops op, const key_type &key, const data_type &value) {
+            Producer &self = producer();
+            std::uint64_t seq = ++self.submitted;
+
+            self.prune();
+            self.pending.push_back(Pending{ key, value, op, seq });
+
+            Op *tmp = new Op();
+            tmp->key = key;
+            tmp->value = value;
+            tmp->op = op;
+            tmp->producer = &self;
+            tmp->seq = seq;
+
+            enqueue(tmp);
+        }
+
+        // Vyukov's intrusive queue: a producer swings head to its node and then links the old head to it.
+        // Both are seq_cst, so either the applier about to sleep finds the node or the producer sees it asleep.
+        void enqueue(Op *op) {
+            push(op);
+
+            if (this->sleeping.load()) {
+                std::lock_guard<std::mutex> guard(this->sleep_mutex);
+                this->wake.notify_one();
+            }
+        }
+
+        void push(Op *op) {
+            Op *prev = this->head.exchange(op);
+            prev->next.store(op, std::memory_order_release);
+        }
+
+        // applier only; nullptr if the queue is empty or its next node isn't linked yet
+        Op* dequeue() {
+            Op *tail = this->tail;
+            Op *next = tail->next.load(std::memory_order_acquire);
+
+            if (tail == &this->stub) {
+                if (next == nullptr) return nullptr;
+
+                this->tail = next;
+                tail = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+
+            if (next != nullptr) {
+                this->tail = next;
+                return tail;
+            }
+
+            if (tail != this->head.load()) return nullptr;
+
+            // tail is the last node, the stub goes behind it so tail can be handed out
+            this->stub.next.store(nullptr, std::memory_order_relaxed);
+            push(&this->stub);
+
+            next = tail->next.load(std::memory_order_acquire);
+            if (next != nullptr) {
+                this->tail = next;
+                return tail;
+            }
+
+            return nullptr;
+        }
+
+        void run() {
+            AVLtree::WriteBatch<tree_type> batch(this->tree_);
+            std::vector<Op*> ops;
+
+            while (true) {
+                for (Op *tmp; (ops.size() < MAX_BATCH) && ((tmp = dequeue()) != nullptr);) ops.push_back(tmp);
+
+                if (ops.empty()) {
+                    std::unique_lock<std::mutex> guard(this->sleep_mutex);
+                    if (this->stop) return;
+
+                    // a producer that missed the flag wakes nobody, the timeout bounds how long that costs
+                    this->sleeping.store(true);
+                    Op *tmp = dequeue();
+
+                    if (tmp != nullptr) ops.push_back(tmp);
+                    else this->wake.wait_for(guard, std::chrono::milliseconds(1));
+
+                    this->sleeping.store(false);
+                    if (ops.empty()) continue;
+                }
+
+                for (Op *tmp : ops) {
+                    if (tmp->op == INSERT) batch.insert(value_type(tmp->key, tmp->value));
+                    else if (tmp->op == ASSIGN) batch.insert_or_assign(tmp->key, tmp->value);
+                    else if (tmp->op == ERASE) batch.erase(tmp->key);
+                }
+
+                batch.apply();
+
+                // a thread's writes come out of the queue in order, so the last store is its highest seq
+                for (Op *tmp : ops) {
+                    if (tmp->op == FENCE) tmp->fence->set_value();
+                    else tmp->producer->applied.store(tmp->seq, std::memory_order_release);
+
+                    delete tmp;
+                }
+
+                ops.clear();
+            }
+        }
+
+        tree_type tree_;
+
+        // producers swing head, the applier alone moves tail
+        Op stub;
+        alignas(64) std::atomic<Op*> head;
+        alignas(64) Op *tail;
+
+        std::atomic<bool> sleeping;
+        bool stop;
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+
+        std::mutex producers_mutex;
+        std::vector<std::unique_ptr<Producer>> producers;
+
+        std::uint64_t id;
+        std::thread applier;
+    };
+}
@@ -0,0 +1,511 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <bitset>
+#include <vector>
+#include <stdexcept>
+#include <shared_mutex>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define AVLTREE_BUCKET_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define AVLTREE_BUCKET_SSE2
+#endif
+
+namespace AVLtreeBucket {
+    template<typename KEY, typename DATA, std::size_t CAPACITY>
+    class Node {
+    protected:
+        using key_type = KEY;
+        using data_type = DATA;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA, std::size_t CAPACITY>
+        friend class AVL_bucket;
+
+        template<typename KEY, typename DATA, std::size_t CAPACITY>
+        friend class BucketIterator;
+
+        explicit Node(Node *p) : keys(), values(), count(0), parent(p), left(nullptr), right(nullptr), height(1) {}
+
+        // sorted; every key of the left subtree is below keys[0], every key of the right one above the last
+        key_type keys[CAPACITY];
+        data_type values[CAPACITY];
+        size_type count;
+
+        Node *parent;
+        Node *left;
+        Node *right;
+        int height;
+    };
+
+    // Walks the tree in key order. Holds no lock: it is only good until the next write.
+    template<typename KEY, typename DATA, std::size_t CAPACITY>
+    class BucketIterator {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type, CAPACITY>;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA, std::size_t CAPACITY>
+        friend class AVL_bucket;
+
+        BucketIterator() noexcept : node(nullptr), index(0), root(nullptr) {}
+
+        key_type get_key() const {
+            return this->node->keys[this->index];
+        }
+
+        data_type get_value() const {
+            return this->node->values[this->index];
+        }
+
+        bool operator==(const BucketIterator &right) const {
+            return (this->node == right.node) && (this->index == right.index);
+        }
+
+        bool operator!=(const BucketIterator &right) const {
+            return !(*this == right);
+        }
+
+        // postfix ++
+        BucketIterator operator++(int) {
+            BucketIterator tmp = *this;
+            plus();
+
+            return tmp;
+        }
+
+        // prefix ++
+        BucketIterator& operator++() {
+            return plus();
+        }
+
+        // postfix --
+        BucketIterator operator--(int) {
+            BucketIterator tmp = *this;
+            minus();
+
+            return tmp;
+        }
+
+        // prefix --
+        BucketIterator& operator--() {
+            return minus();
+        }
+
+    protected:
+        BucketIterator(node_type *n, size_type i, node_type *const *r) noexcept : node(n), index(i), root(r) {}
+
+        BucketIterator& plus() {
+            if (this->node == nullptr) return *this;
+
+            if (++this->index < this->node->count) return *this;
+
+            this->index = 0;
+            if (this->node->right) {
+                this->node = this->node->right;
+                while (this->node->left) this->node = this->node->left;
+
+                return *this;
+            }
+
+            while ((this->node->parent != nullptr) && (this->node == this->node->parent->right)) {
+                this->node = this->node->parent;
+            }
+
+            this->node = this->node->parent;
+            return *this;
+        }
+
+        // end() steps back onto the last key
+        BucketIterator& minus() {
+            if (this->node == nullptr) {
+                this->node = *this->root;
+                if (this->node == nullptr) return *this;
+
+                while (this->node->right) this->node = this->node->right;
+                this->index = this->node->count - 1;
+
+                return *this;
+            }
+
+            if (this->index > 0) {
+                --this->index;
+                return *this;
+            }
+
+            if (this->node->left) {
+                this->node = this->node->left;
+                while (this->node->right) this->node = this->node->right;
+                this->index = this->node->count - 1;
+
+                return *this;
+            }
+
+            node_type *tmp = this->node;
+            while ((tmp->parent != nullptr) && (tmp == tmp->parent->left)) tmp = tmp->parent;
+
+            // the first key stays where it is
+            if (tmp->parent == nullptr) return *this;
+
+            this->node = tmp->parent;
+            this->index = this->node->count - 1;
+
+            return *this;
+        }
+
+        node_type *node;
+        size_type index;
+        node_type *const *root;
+    };
+
+    // AVL tree of sorted buckets, a T-tree: every node holds up to CAPACITY keys, so the tree is about
+    // log2(CAPACITY) levels lower and a search ends in one bucket instead of the last few levels of nodes.
+    // For int32 keys, and int64 ones with AVX2, that bucket is searched with vector compares and a movemask;
+    // other keys use a branch-free loop the compiler can vectorize. A full bucket splits in two, and a new
+    // node is only linked, and the tree only rotated, once per CAPACITY / 2 inserts. A bucket that empties is
+    // unlinked; half-empty buckets are not merged. One shared_mutex guards the tree, as in AVLtree::AVL.
+    template<typename KEY, typename DATA, std::size_t CAPACITY = 16>
+    class AVL_bucket {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type, CAPACITY>;
+        using iterator = BucketIterator<key_type, data_type, CAPACITY>;
+        using value_type = std::pair<const key_type, data_type>;
+        using size_type = std::size_t;
+
+        static_assert((CAPACITY >= 8) && (CAPACITY <= 32) && (CAPACITY % 8 == 0),
+            "a bucket is one to four vectors of eight keys");
+
+        AVL_bucket() : root(nullptr), size_(0) {}
+
+        AVL_bucket(const AVL_bucket &) = delete;
+        AVL_bucket &operator=(const AVL_bucket &) = delete;
+
+        ~AVL_bucket() {
+            std::vector<node_type*> nodes;
+            if (this->root) nodes.push_back(this->root);
+
+            while (!nodes.empty()) {
+                node_type *tmp = nodes.back();
+                nodes.pop_back();
+
+                if (tmp->left) nodes.push_back(tmp->left);
+                if (tmp->right) nodes.push_back(tmp->right);
+                delete tmp;
+            }
+        }
+
+        bool insert(const value_type &value) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            const key_type &key = value.first;
+
+            if (this->root == nullptr) this->root = new node_type(nullptr);
+
+            node_type *node = bounding(key);
+            size_type pos = rank(node->keys, node->count, key);
+
+            if ((pos < node->count) && !(key < node->keys[pos])) return false;
+
+            if (node->count == CAPACITY) {
+                node_type *upper = split(node);
+
+                if (pos > node->count) {
+                    pos -= node->count;
+                    node = upper;
+                }
+            }
+
+            for (size_type i = node->count; i > pos; --i) {
+                node->keys[i] = std::move(node->keys[i - 1]);
+                node->values[i] = std::move(node->values[i - 1]);
+            }
+
+            node->keys[pos] = value.first;
+            node->values[pos] = value.second;
+            node->count++;
+            this->size_++;
+
+            return true;
+        }
+
+        void erase(const key_type &key) {
+            std::unique_lock<std::shared_mutex> guard(mutex);
+            size_type pos;
+            node_type *node = find(key, pos);
+
+            if (node == nullptr) return;
+
+            for (size_type i = pos + 1; i < node->count; ++i) {
+                node->keys[i - 1] = std::move(node->keys[i]);
+                node->values[i - 1] = std::move(node->values[i]);
+            }
+
+            node->count--;
+            this->size_--;
+
+            if (node->count == 0) unlink(node);
+        }
+
+        data_type at(const key_type &key) {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            size_type pos;
+            node_type *node = find(key, pos);
+
+            if (node) return node->values[pos];
+            throw std::out_of_range("key out of range");
+        }
+
+        iterator begin() {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            node_type *tmp = this->root;
+            while (tmp && tmp->left) tmp = tmp->left;
+
+            return iterator(tmp, 0, &this->root);
+        }
+
+        iterator end() {
+            return iterator(nullptr, 0, &this->root);
+        }
+
+        // levels of buckets
+        size_type height() {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            return node_height(this->root);
+        }
+
+        size_type size() {
+            std::shared_lock<std::shared_mutex> guard(mutex);
+            return this->size_;
+        }
+
+    private:
+        // number of keys below key among the first count
+        template<typename K>
+        static size_type rank(const K *keys, size_type count, const K &key) {
+            size_type tmp = 0;
+            for (size_type i = 0; i < count; ++i) tmp += (keys[i] < key);
+
+            return tmp;
+        }
+
+        // the bits past count are cleared, the slots behind them hold stale keys
+        static size_type valid_bits(std::uint64_t mask, size_type count) {
+            return std::bitset<64>(mask & ((std::uint64_t(1) << count) - 1)).count();
+        }
+
+#if defined(AVLTREE_BUCKET_AVX2)
+        static size_type rank(const std::int32_t *keys, size_type count, std::int32_t key) {
+            __m256i needle = _mm256_set1_epi32(key);
+            std::uint64_t mask = 0;
+
+            for (size_type i = 0; i < CAPACITY; i += 8) {
+                __m256i tmp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+                __m256i below = _mm256_cmpgt_epi32(needle, tmp);
+                mask |= std::uint64_t(unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(below)))) << i;
+            }
+
+            return valid_bits(mask, count);
+        }
+
+        static size_type rank(const std::int64_t *keys, size_type count, std::int64_t key) {
+            __m256i needle = _mm256_set1_epi64x(key);
+            std::uint64_t mask = 0;
+
+            for (size_type i = 0; i < CAPACITY; i += 4) {
+                __m256i tmp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+                __m256i below = _mm256_cmpgt_epi64(needle, tmp);
+                mask |= std::uint64_t(unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(below)))) << i;
+            }
+
+            return valid_bits(mask, count);
+        }
+#elif defined(AVLTREE_BUCKET_SSE2)
+        // SSE2 has no 64-bit compare, int64 keys take the loop above
+        static size_type rank(const std::int32_t *keys, size_type count, std::int32_t key) {
+            __m128i needle = _mm_set1_epi32(key);
+            std::uint64_t mask = 0;
+
+            for (size_type i = 0; i < CAPACITY; i += 4) {
+                __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+                __m128i below = _mm_cmpgt_epi32(needle, tmp);
+                mask |= std::uint64_t(unsigned(_mm_movemask_ps(_mm_castsi128_ps(below)))) << i;
+            }
+
+            return valid_bits(mask, count);
+        }
+#endif
+
+        static int node_height(node_type *node) {
+            return (node == nullptr) ? 0 : node->height;
+        }
+
+        static void update_height(node_type *node) {
+            int left = node_height(node->left);
+            int right = node_height(node->right);
+            node->height = 1 + ((left > right) ? left : right);
+        }
+
+        // the node holding key, with its slot in pos, or nullptr
+        node_type* find(const key_type &key, size_type &pos) {
+            node_type *node = this->root;
+
+            while (node != nullptr) {
+                if (key < node->keys[0]) node = node->left;
+                else if (node->keys[node->count - 1] < key) node = node->right;
+                else {
+                    pos = rank(node->keys, node->count, key);
+                    return (key < node->keys[pos]) ? nullptr : node;
+                }
+            }
+
+            return nullptr;
+        }
+
+        // the bucket whose range holds key, or the last one the search passed where key still fits in order
+        node_type* bounding(const key_type &key) {
+            node_type *node = this->root;
+
+            while (node->count != 0) {
+                if (key < node->keys[0]) {
+                    if (!node->left) break;
+                    node = node->left;
+                }
+                else if (node->keys[node->count - 1] < key) {
+                    if (!node->right) break;
+                    node = node->right;
+                }
+                else break;
+            }
+
+            return node;
+        }
+
+        // moves the upper half of a full bucket into a new node right after it in order, returns that node
+        node_type* split(node_type *node) {
+            size_type half = CAPACITY / 2;
+            node_type *upper;
+
+            if (node->right == nullptr) {
+                upper = new node_type(node);
+                node->right = upper;
+            }
+            else {
+                node_type *tmp = node->right;
+                while (tmp->left) tmp = tmp->left;
+
+                upper = new node_type(tmp);
+                tmp->left = upper;
+            }
+
+            for (size_type i = half; i < CAPACITY; ++i) {
+                upper->keys[i - half] = std::move(node->keys[i]);
+                upper->values[i - half] = std::move(node->values[i]);
+            }
+
+            upper->count = CAPACITY - half;
+            node->count = half;
+
+            retrace(upper->parent);
+            return upper;
+        }
+
+        // drops an empty bucket; with two children it takes over its successor's bucket and drops that node
+        void unlink(node_type *node) {
+            if (node->left && node->right) {
+                node_type *next = node->right;
+                while (next->left) next = next->left;
+
+                for (size_type i = 0; i < next->count; ++i) {
+                    node->keys[i] = std::move(next->keys[i]);
+                    node->values[i] = std::move(next->values[i]);
+                }
+
+                node->count = next->count;
+                node = next;
+            }
+
+            node_type *child = node->left ? node->left : node->right;
+            node_type *parent = node->parent;
+
+            replace_child(parent, node, child);
+            if (child) child->parent = parent;
+
+            delete node;
+            retrace(parent);
+        }
+
+        void replace_child(node_type *parent, node_type *old_child, node_type *new_child) {
+            if (parent == nullptr) this->root = new_child;
+            else if (parent->left == old_child) parent->left = new_child;
+            else parent->right = new_child;
+        }
+
+        // node's left child takes its place, returns it
+        node_type* right_rotation(node_type *node) {
+            node_type *tmp = node->left;
+
+            node->left = tmp->right;
+            if (node->left) node->left->parent = node;
+
+            tmp->parent = node->parent;
+            replace_child(node->parent, node, tmp);
+
+            tmp->right = node;
+            node->parent = tmp;
+
+            update_height(node);
+            update_height(tmp);
+
+            return tmp;
+        }
+
+        node_type* left_rotation(node_type *node) {
+            node_type *tmp = node->right;
+
+            node->right = tmp->left;
+            if (node->right) node->right->parent = node;
+
+            tmp->parent = node->parent;
+            replace_child(node->parent, node, tmp);
+
+            tmp->left = node;
+            node->parent = tmp;
+
+            update_height(node);
+            update_height(tmp);
+
+            return tmp;
+        }
+
+        // restores heights and balance from node up to the root
+        void retrace(node_type *node) {
+            while (node != nullptr) {
+                int balance = node_height(node->left) - node_height(node->right);
+
+                if (balance > 1) {
+                    if (node_height(node->left->left) < node_height(node->left->right)) left_rotation(node->left);
+                    node = right_rotation(node);
+                }
+                else if (balance < -1) {
+                    if (node_height(node->right->right) < node_height(node->right->left)) right_rotation(node->right);
+                    node = left_rotation(node);
+                }
+                else update_height(node);
+
+                node = node->parent;
+            }
+        }
+
+        std::shared_mutex mutex;
+        node_type *root;
+        size_type size_;
+    };
+}
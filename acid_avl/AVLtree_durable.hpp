@@ -0,0 +1,297 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include "AVLtree.hpp"
+#include "WriteAheadLog.hpp"
+
+namespace AVLtreeDurable {
+    // An AVL tree whose writes survive a crash. Every change is appended to a write-ahead log and the call
+    // waits for the log to reach the disk; concurrent writers share their syncs through the log's group
+    // commit. Only then is the change made to the tree, in log order, so no reader sees a write a crash could
+    // still lose: one of the writers a sync covered applies all of their changes as one WriteBatch, under one
+    // acquisition of the tree's lock. A sync still covers at most one write per writer, so with every write
+    // synced the disk's sync rate, not the tree, bounds the throughput. Opening the same path again replays
+    // the log in bulk: the records of each key are applied in order, and the survivors are loaded with one
+    // bulk_load instead of one insert each. Keys and values are logged as raw bytes, so both have to be
+    // trivially copyable. The log only grows, each run appends to what the last one left.
+    // Opened with synchronous = false, writes return as soon as they are logged in memory and are visible at
+    // once; they become durable together at the next sync(), or when the map closes, and a crash loses the
+    // writes since the last sync.
+    // A write that is logged but then can't be made to the tree, say for lack of memory, leaves the tree
+    // behind its log. Its writer gets the exception, and every write after it throws too, as the map would
+    // otherwise drift further from what a replay gives. Opening the path again brings back every logged write.
+    template<typename KEY, typename DATA, template<typename> class POINTER = AVLtree::IntrusivePointer,
+        typename ALLOC = AVLtree::HeapAllocator>
+    class DurableAVL {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using tree_type = AVLtree::AVL<key_type, data_type, POINTER, ALLOC>;
+        using value_type = std::pair<const key_type, data_type>;
+        using size_type = std::size_t;
+
+        static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<data_type>::value,
+            "keys and values are logged byte for byte");
+
+        explicit DurableAVL(const std::string &path, bool synchronous = true) : log(path), batch(tree_),
+            head(nullptr), tail(nullptr), applying(false), damaged(false), synchronous(synchronous) {
+            std::vector<Record> records;
+
+            this->replayed = this->log.replay([&](const void *payload, std::size_t size) {
+                Record tmp;
+                if (decode(payload, size, tmp)) records.push_back(tmp);
+            });
+
+            // stable, so among the records of a key the last one written stays last
+            std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) {
+                return a.key < b.key;
+            });
+
+            std::vector<std::pair<key_type, data_type>> live;
+            for (size_type i = 0, j; i < records.size(); i = j) {
+                bool present = false;
+                data_type value = data_type();
+
+                for (j = i; (j < records.size()) && (!(records[i].key < records[j].key)); ++j) {
+                    if (records[j].op == ERASE) present = false;
+                    else if ((records[j].op == PUT) || (!present)) {
+                        present = true;
+                        value = records[j].value;
+                    }
+                }
+
+                if (present) live.emplace_back(records[i].key, value);
+            }
+
+            this->tree_.bulk_load(live.begin(), live.end());
+        }
+
+        DurableAVL(const DurableAVL &) = delete;
+        DurableAVL &operator=(const DurableAVL &) = delete;
+
+        // Logged even if key is there: whether it is can only be known once the writes logged before it are
+        // applied, so the record means "unless present", at replay too.
+        bool insert(const value_type &value) {
+            return write(INSERT, value.first, value.second, [&] { return this->tree_.insert(value); });
+        }
+
+        bool insert_or_assign(const key_type &key, const data_type &obj) {
+            return write(PUT, key, obj, [&] { return this->tree_.insert_or_assign(key, obj); });
+        }
+
+        // logged even if key isn't there, for the same reason
+        void erase(const key_type &key) {
+            write(ERASE, key, data_type(), [&] {
+                this->tree_.erase(key);
+                return false;
+            });
+        }
+
+        // returns once every write made so far is on disk
+        void sync() {
+            this->log.commit(this->log.size());
+        }
+
+        data_type at(const key_type &key) {
+            return this->tree_.at(key);
+        }
+
+        size_type size() {
+            return this->tree_.size();
+        }
+
+        // records read back when the map was opened
+        size_type replayed_records() const {
+            return this->replayed;
+        }
+
+        // for reads only, a change made through it is not logged
+        tree_type& tree() {
+            return this->tree_;
+        }
+
+    private:
+        enum ops : unsigned char { PUT = 1, ERASE = 2, INSERT = 3 };
+
+        // op, key, then the value for a PUT or an INSERT
+        static const std::size_t PUT_SIZE = 1 + sizeof(key_type) + sizeof(data_type);
+        static const std::size_t ERASE_SIZE = 1 + sizeof(key_type);
+
+        struct Record {
+            key_type key;
+            data_type value;
+            ops op;
+        };
+
+        // a synchronous write between its commit and the tree, on its writer's stack
+        struct Pending {
+            ops op;
+            key_type key;
+            data_type value;
+            std::uint64_t position;
+            Pending *next;
+            bool result;
+            bool done;
+            std::exception_ptr failure;
+        };
+
+        static bool decode(const void *payload, std::size_t size, Record &out) {
+            const unsigned char *bytes = static_cast<const unsigned char*>(payload);
+            if (size < ERASE_SIZE) return false;
+
+            out.op = static_cast<ops>(bytes[0]);
+            std::memcpy(&out.key, bytes + 1, sizeof(key_type));
+
+            if (((out.op == PUT) || (out.op == INSERT)) && (size == PUT_SIZE)) {
+                std::memcpy(&out.value, bytes + 1 + sizeof(key_type), sizeof(data_type));
+                return true;
+            }
+
+            return (out.op == ERASE) && (size == ERASE_SIZE);
+        }
+
+        // Appends the change and, once it is durable, makes it. A synchronous write queues itself in log order
+        // and commits; afterwards whichever of the waiting writers finds nobody applying takes every queued write
+        // the log has synced so far and applies them together, so a group commit costs one tree lock, not one
+        // per write. A failed commit takes its write back out of the queue.
+        template<typename APPLY>
+        bool write(ops op, const key_type &key, const data_type &value, APPLY apply) {
+            std::unique_lock<std::mutex> guard(this->order);
+            if (this->damaged) throw std::runtime_error(DAMAGED);
+
+            std::uint64_t position = append(op, key, value);
+
+            if (!this->synchronous) {
+                try {
+                    return apply();
+                }
+                catch (...) {
+                    this->damaged = true;
+                    throw;
+                }
+            }
+
+            Pending pending{ op, key, value, position, nullptr, false, false, nullptr };
+            if (this->tail) this->tail->next = &pending;
+            else this->head = &pending;
+            this->tail = &pending;
+            guard.unlock();
+
+            try {
+                this->log.commit(position);
+            }
+            catch (...) {
+                guard.lock();
+                unqueue(&pending);
+                throw;
+            }
+
+            guard.lock();
+            while (!pending.done) {
+                if (this->applying) this->turn.wait(guard);
+                else apply_synced(guard);
+            }
+
+            if (pending.failure) std::rethrow_exception(pending.failure);
+            return pending.result;
+        }
+
+        // Under order, with nobody else applying: applies every queued write up to the log's synced position,
+        // with order released meanwhile, then hands the writers their results.
+        void apply_synced(std::unique_lock<std::mutex> &guard) {
+            std::uint64_t synced = this->log.synced();
+            Pending *first = this->head, *last = nullptr;
+
+            for (Pending *tmp = first; (tmp != nullptr) && (tmp->position <= synced); tmp = tmp->next) last = tmp;
+            if (last == nullptr) return;
+
+            this->head = last->next;
+            if (this->head == nullptr) this->tail = nullptr;
+            last->next = nullptr;
+
+            bool skip = this->damaged;
+            this->applying = true;
+            guard.unlock();
+
+            std::exception_ptr failure;
+            try {
+                if (skip) throw std::runtime_error(DAMAGED);
+
+                for (Pending *tmp = first; tmp != nullptr; tmp = tmp->next) {
+                    if (tmp->op == INSERT) this->batch.insert(value_type(tmp->key, tmp->value));
+                    else if (tmp->op == PUT) this->batch.insert_or_assign(tmp->key, tmp->value);
+                    else this->batch.erase(tmp->key);
+                }
+
+                this->batch.apply(this->results);
+            }
+            catch (...) {
+                failure = std::current_exception();
+                this->batch.clear();
+            }
+
+            guard.lock();
+            if (failure) this->damaged = true;
+
+            // a writer only leaves once it sees done, and it needs order for that
+            size_type i = 0;
+            for (Pending *tmp = first; tmp != nullptr; tmp = tmp->next, ++i) {
+                tmp->result = (!failure) && this->results[i];
+                tmp->failure = failure;
+                tmp->done = true;
+            }
+
+            this->applying = false;
+            this->turn.notify_all();
+        }
+
+        // under order
+        void unqueue(Pending *pending) {
+            Pending *prev = nullptr;
+            for (Pending *tmp = this->head; tmp != pending; tmp = tmp->next) prev = tmp;
+
+            if (prev) prev->next = pending->next;
+            else this->head = pending->next;
+            if (this->tail == pending) this->tail = prev;
+        }
+
+        // under order, so positions go up in queue order
+        std::uint64_t append(ops op, const key_type &key, const data_type &value) {
+            unsigned char buffer[PUT_SIZE];
+
+            buffer[0] = op;
+            std::memcpy(buffer + 1, &key, sizeof(key_type));
+            if (op != ERASE) std::memcpy(buffer + 1 + sizeof(key_type), &value, sizeof(data_type));
+
+            return this->log.append(buffer, static_cast<std::uint32_t>((op != ERASE) ? PUT_SIZE : ERASE_SIZE));
+        }
+
+        static constexpr const char *DAMAGED = "a logged write couldn't be applied, reopen the map to get it back";
+
+        AVLtree::WriteAheadLog log;
+        tree_type tree_;
+        std::mutex order;
+        // used by the one writer applying at a time
+        AVLtree::WriteBatch<tree_type> batch;
+        std::vector<bool> results;
+        // synchronous writes not yet applied, in log order
+        Pending *head;
+        Pending *tail;
+        std::condition_variable turn;
+        bool applying;
+        bool damaged;
+        size_type replayed;
+        bool synchronous;
+    };
+}
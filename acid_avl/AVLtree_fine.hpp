@@ -0,0 +1,554 @@
+#pragma once
+
+#include <utility>
+#include <atomic>
+#include <vector>
+#include <stdexcept>
+#include <shared_mutex>
+
+namespace AVLtreeFine {
+    enum states {
+        REMOVED,
+        BEGIN,
+        VALID,
+        END,
+        ROOT,
+    };
+
+    template<typename KEY, typename DATA>
+    class Node {
+    protected:
+        using key_type = KEY;
+        using data_type = DATA;
+        using value_type = std::pair<const key_type, data_type>;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA>
+        friend class AVLiterator;
+
+        template<typename KEY, typename DATA>
+        friend class AVL_fine;
+
+        template<typename... ARGS>
+        Node(states st, ARGS&&... args) : data(std::forward<ARGS>(args)...), left(nullptr), right(nullptr), height(0),
+            prev(nullptr), next(nullptr), ref_count(0), state(st) {}
+
+        // drops one reference; a node that goes away lets go of its list neighbours too
+        static void release(Node *node) {
+            if (--node->ref_count != 0) return;
+
+            std::vector<Node*> nodes(1, node);
+            while (!nodes.empty()) {
+                Node *tmp = nodes.back();
+                nodes.pop_back();
+
+                if ((tmp->prev != nullptr) && (--tmp->prev->ref_count == 0)) nodes.push_back(tmp->prev);
+                if ((tmp->next != nullptr) && (--tmp->next->ref_count == 0)) nodes.push_back(tmp->next);
+                delete tmp;
+            }
+        }
+
+        value_type data;
+
+        // tree links, guarded by mutex and only ever walked top-down
+        Node *left;
+        Node *right;
+        int height;
+        std::shared_mutex mutex;
+
+        // in-order list links for iterators, guarded by list_mutex; a removed node keeps its last neighbours
+        Node *prev;
+        Node *next;
+        std::shared_mutex list_mutex;
+
+        // one for the tree, one for each list link pointing here, one for each iterator
+        std::atomic<size_type> ref_count;
+        std::atomic<states> state;
+    };
+
+    template<typename KEY, typename DATA>
+    class AVLiterator {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type>;
+        using value_type = std::pair<const key_type, data_type>;
+
+        template<typename KEY, typename DATA>
+        friend class AVL_fine;
+
+        AVLiterator() noexcept : ptr(nullptr) {}
+
+        AVLiterator(const AVLiterator &iterator) noexcept : ptr(iterator.ptr) {
+            if (this->ptr != nullptr) this->ptr->ref_count++;
+        }
+
+        ~AVLiterator() {
+            if (this->ptr != nullptr) node_type::release(this->ptr);
+        }
+
+        AVLiterator& operator=(const AVLiterator &iterator) {
+            if (iterator.ptr != nullptr) iterator.ptr->ref_count++;
+            if (this->ptr != nullptr) node_type::release(this->ptr);
+            this->ptr = iterator.ptr;
+
+            return *this;
+        }
+
+        // keys and values are never written after insertion, so no lock is needed to read them
+        key_type get_key() {
+            return this->ptr->data.first;
+        }
+
+        data_type get_value() {
+            return this->ptr->data.second;
+        }
+
+        bool operator==(const AVLiterator &right) {
+            return this->ptr == right.ptr;
+        }
+
+        bool operator!=(const AVLiterator &right) {
+            return this->ptr != right.ptr;
+        }
+
+        // postfix ++
+        AVLiterator operator++(int) {
+            AVLiterator tmp = *this;
+            plus();
+
+            return tmp;
+        }
+
+        // prefix ++
+        AVLiterator& operator++() {
+            return plus();
+        }
+
+        // postfix --
+        AVLiterator operator--(int) {
+            AVLiterator tmp = *this;
+            minus();
+
+            return tmp;
+        }
+
+        // prefix --
+        AVLiterator& operator--() {
+            return minus();
+        }
+
+    protected:
+        explicit AVLiterator(node_type *node) noexcept : ptr(node) {
+            this->ptr->ref_count++;
+        }
+
+        // steps over nodes erased behind the iterator's back, their links still lead forward
+        AVLiterator& plus() {
+            while (this->ptr->state != states::END) {
+                std::shared_lock<std::shared_mutex> guard(this->ptr->list_mutex);
+                node_type *tmp = this->ptr;
+                this->ptr = tmp->next;
+                this->ptr->ref_count++;
+                guard.unlock();
+
+                node_type::release(tmp);
+                if (this->ptr->state != states::REMOVED) break;
+            }
+
+            return *this;
+        }
+
+        AVLiterator& minus() {
+            while (true) {
+                std::shared_lock<std::shared_mutex> guard(this->ptr->list_mutex);
+                node_type *tmp = this->ptr;
+                if (tmp->prev->state == states::BEGIN) break;
+
+                this->ptr = tmp->prev;
+                this->ptr->ref_count++;
+                guard.unlock();
+
+                node_type::release(tmp);
+                if (this->ptr->state != states::REMOVED) break;
+            }
+
+            return *this;
+        }
+
+        node_type *ptr;
+    };
+
+    // AVL tree with a lock in every node instead of one for the whole tree. Writers lock-couple from the
+    // root down and let go of everything above the parent of the deepest node whose height can't change,
+    // so writers in disjoint subtrees run side by side; rotations only touch nodes the writer holds.
+    // Iterators walk a separate in-order list the same way List_fine does and never touch the tree locks.
+    template<typename KEY, typename DATA>
+    class AVL_fine {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type>;
+        using value_type = std::pair<const key_type, data_type>;
+        using iterator = AVLiterator<key_type, data_type>;
+        using size_type = std::size_t;
+
+        AVL_fine() : holder(new node_type(states::ROOT)), head(new node_type(states::BEGIN)),
+            last(new node_type(states::END)), size_(0) {
+            this->holder->ref_count++;
+            this->head->ref_count++;
+            this->last->ref_count++;
+
+            this->head->next = this->last;
+            this->last->prev = this->head;
+        }
+
+        ~AVL_fine() {
+            node_type *tmp = this->head;
+
+            while (tmp != this->last) {
+                node_type *next = tmp->next;
+                delete tmp;
+                tmp = next;
+            }
+
+            delete this->last;
+            delete this->holder;
+        }
+
+        iterator begin() {
+            std::shared_lock<std::shared_mutex> guard(this->head->list_mutex);
+            return iterator(this->head->next);
+        }
+
+        iterator end() {
+            return iterator(this->last);
+        }
+
+        bool insert(const value_type &value) {
+            node_type **path[MAX_HEIGHT];
+            node_type *locked[MAX_HEIGHT + 1];
+            int depth = 0, first = 0, count = 0;
+
+            this->holder->mutex.lock();
+            locked[count++] = this->holder;
+            node_type **slot = &this->holder->left;
+
+            while (*slot != nullptr) {
+                node_type *node = *slot;
+                node->mutex.lock();
+                locked[count++] = node;
+
+                if (value.first == node->data.first) {
+                    unlock(locked, first, count);
+                    return false;
+                }
+
+                bool go_left = value.first < node->data.first;
+                node_type *next = go_left ? node->left : node->right;
+                node_type *other = go_left ? node->right : node->left;
+
+                // the lower side may grow by one without node's height or shape changing; node's parent
+                // stays locked as well, since a rotation above could otherwise move node to another slot
+                if (node_height(next) < node_height(other)) {
+                    unlock(locked, first, count - 2);
+                    first = count - 2;
+                    depth = 0;
+                }
+
+                path[depth++] = slot;
+                slot = go_left ? &node->left : &node->right;
+            }
+
+            node_type *parent = locked[count - 1];
+            node_type *leaf = new node_type(states::VALID, value);
+            leaf->height = 1;
+            leaf->ref_count++;
+
+            if (parent == this->holder) link_after(this->head, leaf);
+            else if (slot == &parent->left) link_before(parent, leaf);
+            else link_after(parent, leaf);
+
+            *slot = leaf;
+            this->size_++;
+
+            retrace(path, depth, false);
+            unlock(locked, first, count);
+
+            return true;
+        }
+
+        void erase(const key_type &key) {
+            node_type **path[MAX_HEIGHT];
+            node_type *locked[MAX_HEIGHT + 1];
+            int depth = 0, first = 0, count = 0;
+
+            this->holder->mutex.lock();
+            locked[count++] = this->holder;
+            node_type **slot = &this->holder->left;
+            node_type *node;
+
+            while (true) {
+                node = *slot;
+                if (node == nullptr) {
+                    unlock(locked, first, count);
+                    return;
+                }
+
+                node->mutex.lock();
+                locked[count++] = node;
+                path[depth++] = slot;
+
+                if (key == node->data.first) break;
+
+                bool go_left = key < node->data.first;
+                node_type *next = go_left ? node->left : node->right;
+                node_type *other = go_left ? node->right : node->left;
+
+                // with both sides level, losing a level below leaves node's height and shape alone
+                if (node_height(next) == node_height(other)) {
+                    unlock(locked, first, count - 2);
+                    first = count - 2;
+                    path[0] = slot;
+                    depth = 1;
+                }
+
+                slot = go_left ? &node->left : &node->right;
+            }
+
+            int index = depth - 1;
+
+            if ((node->left == nullptr) || (node->right == nullptr)) {
+                *path[index] = node->left ? node->left : node->right;
+                depth = index;
+            }
+            else {
+                // the successor is moved into node's place, the whole way down to it stays locked
+                node_type **next_slot = &node->right;
+
+                while (true) {
+                    node_type *tmp = *next_slot;
+                    tmp->mutex.lock();
+                    locked[count++] = tmp;
+
+                    if (tmp->left == nullptr) break;
+
+                    path[depth++] = next_slot;
+                    next_slot = &tmp->left;
+                }
+
+                node_type *next = *next_slot;
+                *next_slot = next->right;
+
+                next->left = node->left;
+                next->right = node->right;
+                next->height = node->height;
+                *path[index] = next;
+
+                if (depth > index + 1) path[index + 1] = &next->right;
+            }
+
+            unlink(node);
+            this->size_--;
+
+            retrace(path, depth, true);
+            unlock(locked, first, count);
+
+            node_type::release(node);
+        }
+
+        data_type at(const key_type &key) {
+            node_type *node = this->holder;
+            node->mutex.lock_shared();
+            node_type *next = node->left;
+
+            while ((next != nullptr) && (next->data.first != key)) {
+                next->mutex.lock_shared();
+                node->mutex.unlock_shared();
+                node = next;
+                next = (key < node->data.first) ? node->left : node->right;
+            }
+
+            if (next == nullptr) {
+                node->mutex.unlock_shared();
+                throw std::out_of_range("key out of range");
+            }
+
+            data_type value = next->data.second;
+            node->mutex.unlock_shared();
+
+            return value;
+        }
+
+        size_type height() {
+            std::shared_lock<std::shared_mutex> guard(this->holder->mutex);
+            return node_height(this->holder->left);
+        }
+
+        size_type size() {
+            return this->size_.load();
+        }
+
+    private:
+        static const int MAX_HEIGHT = 128;
+
+        static void unlock(node_type **locked, int first, int count) {
+            for (int i = first; i < count; ++i) locked[i]->mutex.unlock();
+        }
+
+        static int node_height(node_type *node) {
+            return (node == nullptr) ? 0 : node->height;
+        }
+
+        static void update_height(node_type *node) {
+            int left = node_height(node->left);
+            int right = node_height(node->right);
+            node->height = 1 + ((left > right) ? left : right);
+        }
+
+        static void right_rotation(node_type *&slot) {
+            node_type *node = slot;
+            node_type *tmp = node->left;
+
+            node->left = tmp->right;
+            tmp->right = node;
+            slot = tmp;
+
+            update_height(node);
+            update_height(tmp);
+        }
+
+        static void left_rotation(node_type *&slot) {
+            node_type *node = slot;
+            node_type *tmp = node->right;
+
+            node->right = tmp->left;
+            tmp->left = node;
+            slot = tmp;
+
+            update_height(node);
+            update_height(tmp);
+        }
+
+        static void rebalance(node_type *&slot) {
+            node_type *node = slot;
+            int balance = node_height(node->left) - node_height(node->right);
+
+            if (balance > 1) {
+                if (node_height(node->left->left) < node_height(node->left->right)) left_rotation(node->left);
+                right_rotation(slot);
+            }
+            else if (balance < -1) {
+                if (node_height(node->right->right) < node_height(node->right->left)) right_rotation(node->right);
+                left_rotation(slot);
+            }
+            else update_height(node);
+        }
+
+        // After an insert the heavy side is always on the locked path. After an erase it is the other side,
+        // so the heavy child, and its inner child for a double rotation, are locked just for the rotation.
+        void retrace(node_type ***path, int depth, bool lock_heavy) {
+            for (int i = depth - 1; i >= 0; --i) {
+                node_type *node = *path[i];
+                int old_height = node->height;
+                int balance = node_height(node->left) - node_height(node->right);
+
+                if (lock_heavy && ((balance > 1) || (balance < -1))) {
+                    node_type *heavy = (balance > 1) ? node->left : node->right;
+                    heavy->mutex.lock();
+
+                    node_type *outer = (balance > 1) ? heavy->left : heavy->right;
+                    node_type *inner = (balance > 1) ? heavy->right : heavy->left;
+                    bool twice = node_height(outer) < node_height(inner);
+                    if (twice) inner->mutex.lock();
+
+                    rebalance(*path[i]);
+
+                    if (twice) inner->mutex.unlock();
+                    heavy->mutex.unlock();
+                }
+                else rebalance(*path[i]);
+
+                if ((*path[i])->height == old_height) break;
+            }
+        }
+
+        // pred is locked for the tree, so nothing can slip in right after it
+        void link_after(node_type *pred, node_type *node) {
+            std::unique_lock<std::shared_mutex> guard_l(pred->list_mutex);
+            node_type *succ = pred->next;
+            std::unique_lock<std::shared_mutex> guard_r(succ->list_mutex);
+
+            node->prev = pred;
+            node->next = succ;
+            node->ref_count += 2;
+
+            pred->next = node;
+            succ->prev = node;
+        }
+
+        // list locks are always taken left to right, so the predecessor is read first and checked afterwards
+        void link_before(node_type *succ, node_type *node) {
+            for (bool retry = true; retry;) {
+                std::shared_lock<std::shared_mutex> guard(succ->list_mutex);
+                node_type *pred = succ->prev;
+                pred->ref_count++;
+                guard.unlock();
+
+                std::unique_lock<std::shared_mutex> guard_l(pred->list_mutex);
+                std::unique_lock<std::shared_mutex> guard_r(succ->list_mutex);
+
+                if ((pred->next == succ) && (succ->prev == pred)) {
+                    node->prev = pred;
+                    node->next = succ;
+                    node->ref_count += 2;
+
+                    pred->next = node;
+                    succ->prev = node;
+
+                    retry = false;
+                }
+
+                guard_r.unlock();
+                guard_l.unlock();
+                node_type::release(pred);
+            }
+        }
+
+        // takes node out of the list; its own links stay so iterators standing on it can move on
+        void unlink(node_type *node) {
+            for (bool retry = true; retry;) {
+                std::shared_lock<std::shared_mutex> guard(node->list_mutex);
+                node_type *pred = node->prev;
+                pred->ref_count++;
+                guard.unlock();
+
+                std::unique_lock<std::shared_mutex> guard_l(pred->list_mutex);
+                std::unique_lock<std::shared_mutex> guard_c(node->list_mutex);
+
+                if (pred->next == node) {
+                    node_type *succ = node->next;
+                    std::unique_lock<std::shared_mutex> guard_r(succ->list_mutex);
+
+                    node->state = states::REMOVED;
+                    pred->next = succ;
+                    succ->prev = pred;
+                    pred->ref_count++;
+                    succ->ref_count++;
+                    node->ref_count -= 2;
+
+                    retry = false;
+                }
+
+                guard_c.unlock();
+                guard_l.unlock();
+                node_type::release(pred);
+            }
+        }
+
+        node_type *holder;
+        node_type *head;
+        node_type *last;
+        std::atomic<size_type> size_;
+    };
+}
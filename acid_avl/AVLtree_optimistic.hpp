@@ -0,0 +1,361 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+#include "Epoch.hpp"
+
+namespace AVLtreeOptimistic {
+    using AVLtree::Epoch;
+
+    template<typename KEY, typename DATA>
+    class Node {
+    protected:
+        using key_type = KEY;
+        using data_type = DATA;
+        using value_type = std::pair<const key_type, data_type>;
+        using version_type = std::uint64_t;
+
+        template<typename KEY, typename DATA>
+        friend class AVL_optimistic;
+
+        Node() : data(), parent(nullptr), left(nullptr), right(nullptr), height(0), version(0), present(false) {}
+
+        template<typename... ARGS>
+        Node(Node *p, ARGS&&... args) : data(std::forward<ARGS>(args)...), parent(p), left(nullptr), right(nullptr),
+            height(1), version(0), present(true) {}
+
+        // never written after the node is published, readers may copy it without any lock
+        value_type data;
+
+        // parent and height are only touched by the writer holding the tree mutex
+        Node *parent;
+        std::atomic<Node*> left;
+        std::atomic<Node*> right;
+        int height;
+
+        std::atomic<version_type> version;
+        // false for a routing node: its key is erased but it still has two children to route through
+        std::atomic<bool> present;
+    };
+
+    // AVL tree in the style of Bronson et al.: readers never take a lock and never write shared memory, they
+    // descend hand-over-hand validating per-node versions and retry from the nearest unchanged ancestor if a
+    // rotation moved keys out from under them. Writers are serialized by a mutex readers never look at.
+    // Unlinked nodes are freed through Epoch once no reader can still hold them.
+    template<typename KEY, typename DATA>
+    class AVL_optimistic {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type>;
+        using value_type = std::pair<const key_type, data_type>;
+        using size_type = std::size_t;
+        using version_type = std::uint64_t;
+
+        AVL_optimistic() : holder(new node_type()), size_(0) {}
+
+        ~AVL_optimistic() {
+            std::vector<node_type*> nodes;
+            if (this->holder->right.load()) nodes.push_back(this->holder->right.load());
+
+            while (!nodes.empty()) {
+                node_type *tmp = nodes.back();
+                nodes.pop_back();
+
+                if (tmp->left.load()) nodes.push_back(tmp->left.load());
+                if (tmp->right.load()) nodes.push_back(tmp->right.load());
+                delete tmp;
+            }
+
+            delete this->holder;
+        }
+
+        bool insert(const value_type &value) {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            node_type *parent = this->holder;
+            node_type *node = this->holder->right.load();
+            bool go_left = false;
+
+            while ((node != nullptr) && (node->data.first != value.first)) {
+                parent = node;
+                go_left = value.first < node->data.first;
+                node = go_left ? node->left.load() : node->right.load();
+            }
+
+            if (node == nullptr) {
+                node_type *leaf = new node_type(parent, value);
+                if (go_left) parent->left.store(leaf);
+                else parent->right.store(leaf);
+
+                this->size_++;
+                fix_up(parent);
+
+                return true;
+            }
+
+            if (node->present.load()) return false;
+
+            // a routing node's payload may still be read by someone, so it is replaced, not revived
+            node_type *tmp = new node_type(node->parent, value);
+            tmp->left.store(node->left.load());
+            tmp->right.store(node->right.load());
+            tmp->height = node->height;
+            if (tmp->left.load()) tmp->left.load()->parent = tmp;
+            if (tmp->right.load()) tmp->right.load()->parent = tmp;
+
+            replace_child(node->parent, node, tmp);
+            node->version.store(UNLINKED);
+            Epoch::retire(node, &AVL_optimistic::delete_node);
+            this->size_++;
+
+            return true;
+        }
+
+        bool erase(const key_type &key) {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            node_type *node = this->holder->right.load();
+
+            while ((node != nullptr) && (node->data.first != key)) {
+                node = (key < node->data.first) ? node->left.load() : node->right.load();
+            }
+
+            if ((node == nullptr) || (!node->present.load())) return false;
+
+            node->present.store(false);
+            this->size_--;
+
+            if ((node->left.load() == nullptr) || (node->right.load() == nullptr)) {
+                node_type *parent = node->parent;
+                unlink(node);
+                fix_up(parent);
+            }
+
+            return true;
+        }
+
+        data_type at(const key_type &key) {
+            Epoch::Guard guard;
+            node_type *tmp = find(key);
+
+            if (tmp) return tmp->data.second;
+            throw std::out_of_range("key out of range");
+        }
+
+        bool contains(const key_type &key) {
+            Epoch::Guard guard;
+            return find(key) != nullptr;
+        }
+
+        size_type height() {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            return node_height(this->holder->right.load());
+        }
+
+        size_type size() {
+            return this->size_.load();
+        }
+
+    private:
+        static const int MAX_HEIGHT = 128;
+
+        static const version_type UNLINKED = 1;
+        static const version_type SHRINKING = 2;
+        static const version_type STEP = 4;
+
+        struct Frame {
+            node_type *node;
+            version_type version;
+        };
+
+        static void delete_node(void *ptr) {
+            delete static_cast<node_type*>(ptr);
+        }
+
+        // Returns the present node holding key, or nullptr. Must run inside an Epoch::Guard.
+        // A child is only entered after its parent's version is re-checked, so the child really was
+        // responsible for key at that moment; a changed version sends the search back one level.
+        node_type* find(const key_type &key) {
+            Frame stack[MAX_HEIGHT];
+            int top = 0;
+
+            // the holder's key range never changes, so its version never does either
+            stack[0].node = this->holder;
+            stack[0].version = 0;
+
+            while (true) {
+                node_type *node = stack[top].node;
+                version_type ovl = stack[top].version;
+                node_type *child;
+
+                if (top == 0) child = node->right.load();
+                else if (key == node->data.first) return node->present.load() ? node : nullptr;
+                else child = (key < node->data.first) ? node->left.load() : node->right.load();
+
+                if (node->version.load() != ovl) {
+                    --top;
+                    continue;
+                }
+
+                if (child == nullptr) return nullptr;
+
+                version_type child_ovl = child->version.load();
+
+                if (child_ovl & SHRINKING) {
+                    while (child->version.load() & SHRINKING) std::this_thread::yield();
+                    continue;
+                }
+
+                if (child_ovl & UNLINKED) continue;
+
+                if (node->version.load() != ovl) {
+                    --top;
+                    continue;
+                }
+
+                ++top;
+                stack[top].node = child;
+                stack[top].version = child_ovl;
+            }
+        }
+
+        static int node_height(node_type *node) {
+            return (node == nullptr) ? 0 : node->height;
+        }
+
+        static void update_height(node_type *node) {
+            int left = node_height(node->left.load());
+            int right = node_height(node->right.load());
+            node->height = 1 + ((left > right) ? left : right);
+        }
+
+        static void replace_child(node_type *parent, node_type *old_child, node_type *new_child) {
+            if (parent->left.load() == old_child) parent->left.store(new_child);
+            else parent->right.store(new_child);
+        }
+
+        // node has at most one child; readers already inside it can still walk on through that child
+        void unlink(node_type *node) {
+            node_type *child = node->left.load() ? node->left.load() : node->right.load();
+
+            replace_child(node->parent, node, child);
+            if (child) child->parent = node->parent;
+
+            node->version.store(UNLINKED);
+            Epoch::retire(node, &AVL_optimistic::delete_node);
+        }
+
+        // node's left child takes its place; keys leave node's subtree, so node shrinks
+        node_type* right_rotation(node_type *node) {
+            node_type *parent = node->parent;
+            node_type *tmp = node->left.load();
+            node_type *tmp_right = tmp->right.load();
+            version_type version = node->version.load();
+
+            node->version.store(version | SHRINKING);
+
+            node->left.store(tmp_right);
+            if (tmp_right) tmp_right->parent = node;
+
+            tmp->right.store(node);
+            node->parent = tmp;
+
+            replace_child(parent, node, tmp);
+            tmp->parent = parent;
+
+            update_height(node);
+            update_height(tmp);
+            node->version.store(version + STEP);
+
+            return tmp;
+        }
+
+        node_type* left_rotation(node_type *node) {
+            node_type *parent = node->parent;
+            node_type *tmp = node->right.load();
+            node_type *tmp_left = tmp->left.load();
+            version_type version = node->version.load();
+
+            node->version.store(version | SHRINKING);
+
+            node->right.store(tmp_left);
+            if (tmp_left) tmp_left->parent = node;
+
+            tmp->left.store(node);
+            node->parent = tmp;
+
+            replace_child(parent, node, tmp);
+            tmp->parent = parent;
+
+            update_height(node);
+            update_height(tmp);
+            node->version.store(version + STEP);
+
+            return tmp;
+        }
+
+        // unlinks a routing node once it is left with fewer than two children
+        bool prune(node_type *node) {
+            if ((node == nullptr) || node->present.load()) return false;
+            if ((node->left.load() != nullptr) && (node->right.load() != nullptr)) return false;
+
+            unlink(node);
+            return true;
+        }
+
+        // returns the root of the rebalanced subtree
+        node_type* rebalance(node_type *node) {
+            while (true) {
+                node_type *left = node->left.load();
+                node_type *right = node->right.load();
+                int balance = node_height(left) - node_height(right);
+
+                if (balance > 1) {
+                    if (node_height(left->left.load()) < node_height(left->right.load())) left_rotation(left);
+                    node = right_rotation(node);
+                }
+                else if (balance < -1) {
+                    if (node_height(right->right.load()) < node_height(right->left.load())) right_rotation(right);
+                    node = left_rotation(node);
+                }
+                else {
+                    update_height(node);
+                    return node;
+                }
+
+                // a routing node pushed down by the rotation may have lost a child on the way
+                bool pruned = prune(node->left.load());
+                pruned = prune(node->right.load()) || pruned;
+                if (!pruned) return node;
+            }
+        }
+
+        // Restores heights and balance from node up to the root, dropping routing nodes that are no longer
+        // needed on the way. Stops as soon as a subtree keeps its height.
+        void fix_up(node_type *node) {
+            while (node != this->holder) {
+                node_type *parent = node->parent;
+
+                if (prune(node)) {
+                    node = parent;
+                    continue;
+                }
+
+                int old_height = node->height;
+                node = rebalance(node);
+
+                if (node->height == old_height) break;
+                node = parent;
+            }
+        }
+
+        std::mutex mutex;
+        node_type *holder;
+        std::atomic<size_type> size_;
+    };
+}
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdexcept>
+
+namespace AVLtreePersistent {
+    template<typename KEY, typename DATA>
+    class Node {
+    protected:
+        using key_type = KEY;
+        using data_type = DATA;
+        using value_type = std::pair<const key_type, data_type>;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA>
+        friend class Snapshot;
+
+        template<typename KEY, typename DATA>
+        friend class SnapshotIterator;
+
+        template<typename KEY, typename DATA>
+        friend class AVL_persistent;
+
+        // takes ownership of one reference to each child
+        Node(const value_type &value, Node *l, Node *r) : data(value), left(l), right(r), ref_count(1) {
+            int left_height = (l == nullptr) ? 0 : l->height;
+            int right_height = (r == nullptr) ? 0 : r->height;
+            this->height = 1 + ((left_height > right_height) ? left_height : right_height);
+        }
+
+        static Node* share(Node *node) {
+            if (node != nullptr) node->ref_count++;
+            return node;
+        }
+
+        // a node is shared by every version that still reaches it, the last one to let go frees it
+        static void release(Node *node) {
+            if ((node == nullptr) || (--node->ref_count != 0)) return;
+
+            std::vector<Node*> nodes(1, node);
+            while (!nodes.empty()) {
+                Node *tmp = nodes.back();
+                nodes.pop_back();
+
+                if ((tmp->left != nullptr) && (--tmp->left->ref_count == 0)) nodes.push_back(tmp->left);
+                if ((tmp->right != nullptr) && (--tmp->right->ref_count == 0)) nodes.push_back(tmp->right);
+                delete tmp;
+            }
+        }
+
+        // never changed once the node is built
+        const value_type data;
+        Node * const left;
+        Node * const right;
+        int height;
+
+        std::atomic<size_type> ref_count;
+    };
+
+    // Walks one version in order. The snapshot it came from must outlive it.
+    template<typename KEY, typename DATA>
+    class SnapshotIterator {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type>;
+
+        template<typename KEY, typename DATA>
+        friend class Snapshot;
+
+        SnapshotIterator() noexcept : depth(0) {}
+
+        key_type get_key() {
+            return this->stack[this->depth - 1]->data.first;
+        }
+
+        data_type get_value() {
+            return this->stack[this->depth - 1]->data.second;
+        }
+
+        bool operator==(const SnapshotIterator &right) {
+            if (this->depth != right.depth) return false;
+            return (this->depth == 0) || (this->stack[this->depth - 1] == right.stack[right.depth - 1]);
+        }
+
+        bool operator!=(const SnapshotIterator &right) {
+            return !(*this == right);
+        }
+
+        // postfix ++
+        SnapshotIterator operator++(int) {
+            SnapshotIterator tmp = *this;
+            plus();
+
+            return tmp;
+        }
+
+        // prefix ++
+        SnapshotIterator& operator++() {
+            return plus();
+        }
+
+    protected:
+        static const int MAX_HEIGHT = 128;
+
+        void push_left(node_type *node) {
+            while (node != nullptr) {
+                this->stack[this->depth++] = node;
+                node = node->left;
+            }
+        }
+
+        SnapshotIterator& plus() {
+            if (this->depth == 0) return *this;
+
+            node_type *tmp = this->stack[--this->depth];
+            push_left(tmp->right);
+
+            return *this;
+        }
+
+        // the path from the root to the current node, minus the nodes already passed on the right
+        node_type *stack[MAX_HEIGHT];
+        int depth;
+    };
+
+    // Immutable handle on one version of the tree. Copying it is O(1); it needs no lock to read, and the
+    // nodes it shares with newer versions stay alive as long as any snapshot holds them.
+    template<typename KEY, typename DATA>
+    class Snapshot {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type>;
+        using iterator = SnapshotIterator<key_type, data_type>;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA>
+        friend class AVL_persistent;
+
+        Snapshot() : root(nullptr), size_(0) {}
+
+        Snapshot(const Snapshot &tmp) : root(node_type::share(tmp.root)), size_(tmp.size_) {}
+
+        Snapshot(Snapshot &&tmp) : root(tmp.root), size_(tmp.size_) {
+            tmp.root = nullptr;
+            tmp.size_ = 0;
+        }
+
+        ~Snapshot() {
+            node_type::release(this->root);
+        }
+
+        Snapshot &operator=(const Snapshot &tmp) {
+            node_type *old = this->root;
+            this->root = node_type::share(tmp.root);
+            this->size_ = tmp.size_;
+            node_type::release(old);
+
+            return *this;
+        }
+
+        Snapshot &operator=(Snapshot &&tmp) {
+            std::swap(this->root, tmp.root);
+            std::swap(this->size_, tmp.size_);
+
+            return *this;
+        }
+
+        iterator begin() const {
+            iterator tmp;
+            tmp.push_left(this->root);
+
+            return tmp;
+        }
+
+        iterator end() const {
+            return iterator();
+        }
+
+        data_type at(const key_type &key) const {
+            node_type *tmp = this->root;
+
+            while (tmp != nullptr) {
+                if (key == tmp->data.first) return tmp->data.second;
+                tmp = (key < tmp->data.first) ? tmp->left : tmp->right;
+            }
+
+            throw std::out_of_range("key out of range");
+        }
+
+        bool contains(const key_type &key) const {
+            node_type *tmp = this->root;
+
+            while (tmp != nullptr) {
+                if (key == tmp->data.first) return true;
+                tmp = (key < tmp->data.first) ? tmp->left : tmp->right;
+            }
+
+            return false;
+        }
+
+        size_type height() const {
+            return (this->root == nullptr) ? 0 : this->root->height;
+        }
+
+        size_type size() const {
+            return this->size_;
+        }
+
+    private:
+        // takes ownership of the reference to root
+        Snapshot(node_type *node, size_type count) : root(node), size_(count) {}
+
+        node_type *root;
+        size_type size_;
+    };
+
+    // Path-copying AVL tree: an update never touches a published node, it rebuilds the path from the root
+    // down to the change and shares every other subtree with the previous version. Writers are serialized
+    // among themselves and only hold the root lock for the pointer swap, so snapshot() is O(1) and readers
+    // of a snapshot never wait for ingest.
+    template<typename KEY, typename DATA>
+    class AVL_persistent {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using node_type = Node<key_type, data_type>;
+        using value_type = std::pair<const key_type, data_type>;
+        using snapshot_type = Snapshot<key_type, data_type>;
+        using size_type = std::size_t;
+
+        AVL_persistent() : root(nullptr), size_(0) {}
+
+        AVL_persistent(const AVL_persistent &) = delete;
+        AVL_persistent &operator=(const AVL_persistent &) = delete;
+
+        ~AVL_persistent() {
+            node_type::release(this->root);
+        }
+
+        snapshot_type snapshot() {
+            std::lock_guard<std::mutex> guard(this->root_mutex);
+            return snapshot_type(node_type::share(this->root), this->size_);
+        }
+
+        bool insert(const value_type &value) {
+            std::lock_guard<std::mutex> guard(this->write_mutex);
+
+            // only the writer ever replaces root, so it can read it without the root lock
+            if (find(this->root, value.first)) return false;
+
+            publish(push(this->root, value), this->size_ + 1);
+            return true;
+        }
+
+        void erase(const key_type &key) {
+            std::lock_guard<std::mutex> guard(this->write_mutex);
+
+            if (!find(this->root, key)) return;
+
+            publish(remove(this->root, key), this->size_ - 1);
+        }
+
+        data_type at(const key_type &key) {
+            return snapshot().at(key);
+        }
+
+        size_type height() {
+            return snapshot().height();
+        }
+
+        size_type size() {
+            std::lock_guard<std::mutex> guard(this->root_mutex);
+            return this->size_;
+        }
+
+    private:
+        static bool find(node_type *node, const key_type &key) {
+            while (node != nullptr) {
+                if (key == node->data.first) return true;
+                node = (key < node->data.first) ? node->left : node->right;
+            }
+
+            return false;
+        }
+
+        static int node_height(node_type *node) {
+            return (node == nullptr) ? 0 : node->height;
+        }
+
+        void publish(node_type *node, size_type count) {
+            std::unique_lock<std::mutex> guard(this->root_mutex);
+            node_type *old = this->root;
+            this->root = node;
+            this->size_ = count;
+            guard.unlock();
+
+            node_type::release(old);
+        }
+
+        // Builds a balanced node out of value and two owned subtrees whose heights differ by at most two.
+        // A rotation can't reuse the heavy child, it is rebuilt and the old one dropped.
+        static node_type* balance(const value_type &value, node_type *left, node_type *right) {
+            int diff = node_height(left) - node_height(right);
+
+            if (diff > 1) {
+                node_type *left_left = left->left;
+                node_type *left_right = left->right;
+                node_type *tmp;
+
+                if (node_height(left_left) >= node_height(left_right)) {
+                    tmp = new node_type(left->data, node_type::share(left_left),
+                        new node_type(value, node_type::share(left_right), right));
+                }
+                else {
+                    tmp = new node_type(left_right->data,
+                        new node_type(left->data, node_type::share(left_left), node_type::share(left_right->left)),
+                        new node_type(value, node_type::share(left_right->right), right));
+                }
+
+                node_type::release(left);
+                return tmp;
+            }
+
+            if (diff < -1) {
+                node_type *right_right = right->right;
+                node_type *right_left = right->left;
+                node_type *tmp;
+
+                if (node_height(right_right) >= node_height(right_left)) {
+                    tmp = new node_type(right->data, new node_type(value, left, node_type::share(right_left)),
+                        node_type::share(right_right));
+                }
+                else {
+                    tmp = new node_type(right_left->data,
+                        new node_type(value, left, node_type::share(right_left->left)),
+                        new node_type(right->data, node_type::share(right_left->right), node_type::share(right_right)));
+                }
+
+                node_type::release(right);
+                return tmp;
+            }
+
+            return new node_type(value, left, right);
+        }
+
+        // returns an owned copy of the path with value added, key must be absent
+        static node_type* push(node_type *node, const value_type &value) {
+            if (node == nullptr) return new node_type(value, nullptr, nullptr);
+
+            if (value.first < node->data.first) {
+                return balance(node->data, push(node->left, value), node_type::share(node->right));
+            }
+
+            return balance(node->data, node_type::share(node->left), push(node->right, value));
+        }
+
+        // unlinks the smallest node of the subtree and hands back its value
+        static node_type* remove_min(node_type *node, const value_type *&min) {
+            if (node->left == nullptr) {
+                min = &node->data;
+                return node_type::share(node->right);
+            }
+
+            return balance(node->data, remove_min(node->left, min), node_type::share(node->right));
+        }
+
+        // returns an owned copy of the path with key removed, key must be present
+        static node_type* remove(node_type *node, const key_type &key) {
+            if (key < node->data.first) {
+                return balance(node->data, remove(node->left, key), node_type::share(node->right));
+            }
+
+            if (node->data.first < key) {
+                return balance(node->data, node_type::share(node->left), remove(node->right, key));
+            }
+
+            if (node->left == nullptr) return node_type::share(node->right);
+            if (node->right == nullptr) return node_type::share(node->left);
+
+            const value_type *min = nullptr;
+            node_type *right = remove_min(node->right, min);
+
+            return balance(*min, node_type::share(node->left), right);
+        }
+
+        std::mutex write_mutex;
+        std::mutex root_mutex;
+        node_type *root;
+        size_type size_;
+    };
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include "AVLtree.hpp"
+
+namespace AVLtreeSharded {
+    // Ordered walk over all shards at once: a k-way merge that keeps every shard's next key in a min-heap.
+    // Each step moves one shard's own iterator, so it locks that shard only and for as long as the tree's
+    // iterators do. The map it came from must outlive it.
+    template<typename TREE>
+    class ShardedIterator {
+    public:
+        using key_type = typename TREE::key_type;
+        using data_type = typename TREE::data_type;
+        using tree_iterator = typename TREE::iterator;
+
+        template<typename KEY, typename DATA, std::size_t SHARDS, template<typename> class POINTER, typename ALLOC>
+        friend class ShardedAVL;
+
+        ShardedIterator() {}
+
+        key_type get_key() {
+            return this->heads[this->heap.front()].key;
+        }
+
+        data_type get_value() {
+            return this->heads[this->heap.front()].it.get_value();
+        }
+
+        bool operator==(const ShardedIterator &right) {
+            if (this->heap.empty() || right.heap.empty()) return this->heap.empty() == right.heap.empty();
+
+            Head &head = this->heads[this->heap.front()];
+            const Head &other = right.heads[right.heap.front()];
+
+            return (head.shard == other.shard) && (head.it == other.it);
+        }
+
+        bool operator!=(const ShardedIterator &right) {
+            return !(*this == right);
+        }
+
+        // postfix ++
+        ShardedIterator operator++(int) {
+            ShardedIterator tmp = *this;
+            plus();
+
+            return tmp;
+        }
+
+        // prefix ++
+        ShardedIterator& operator++() {
+            return plus();
+        }
+
+    protected:
+        struct Head {
+            // cached, so the heap compares keys without taking the shard's lock every time
+            key_type key;
+            tree_iterator it;
+            tree_iterator end;
+            std::size_t shard;
+        };
+
+        // min-heap on key, std:: heaps are max-heaps
+        struct Greater {
+            const std::vector<Head> *heads;
+
+            bool operator()(std::size_t left, std::size_t right) const {
+                return (*heads)[right].key < (*heads)[left].key;
+            }
+        };
+
+        // A shard empty when either iterator was taken gives a null one, which can't be compared; the shard
+        // may have been emptied or filled in between, as nothing holds its lock across both calls.
+        void add(std::size_t shard, tree_iterator it, tree_iterator end) {
+            if ((!it.operator->()) || (!end.operator->()) || (it == end)) return;
+
+            Head head;
+            head.key = it.get_key();
+            head.it = it;
+            head.end = end;
+            head.shard = shard;
+
+            this->heads.push_back(head);
+            this->heap.push_back(this->heads.size() - 1);
+            std::push_heap(this->heap.begin(), this->heap.end(), Greater{ &this->heads });
+        }
+
+        ShardedIterator& plus() {
+            if (this->heap.empty()) return *this;
+
+            std::pop_heap(this->heap.begin(), this->heap.end(), Greater{ &this->heads });
+            Head &head = this->heads[this->heap.back()];
+
+            ++head.it;
+            if (head.it == head.end) {
+                this->heap.pop_back();
+                return *this;
+            }
+
+            head.key = head.it.get_key();
+            std::push_heap(this->heap.begin(), this->heap.end(), Greater{ &this->heads });
+
+            return *this;
+        }
+
+        std::vector<Head> heads;
+        std::vector<std::size_t> heap;
+    };
+
+    // SHARDS independent AVL trees behind one map interface, every one with its own lock, so writers that
+    // land on different shards never wait for each other. Keys go to a shard by hash, which spreads any load
+    // evenly, or by range, given SHARDS - 1 ascending bounds: shard i then holds [bounds[i - 1], bounds[i]),
+    // and range queries only touch the shards they overlap. Ordered iteration works in both modes.
+    // Operations on several shards, size() included, see each shard at a different moment.
+    template<typename KEY, typename DATA, std::size_t SHARDS = 16,
+        template<typename> class POINTER = AVLtree::IntrusivePointer, typename ALLOC = AVLtree::HeapAllocator>
+    class ShardedAVL {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using tree_type = AVLtree::AVL<key_type, data_type, POINTER, ALLOC>;
+        using iterator = ShardedIterator<tree_type>;
+        using value_type = std::pair<const key_type, data_type>;
+        using size_type = std::size_t;
+
+        static_assert(SHARDS > 0, "a map needs at least one shard");
+
+        // hash partitioned
+        ShardedAVL() {}
+
+        // range partitioned
+        explicit ShardedAVL(std::vector<key_type> bounds) : bounds(std::move(bounds)) {
+            if (this->bounds.size() != SHARDS - 1) throw std::invalid_argument("a range map needs SHARDS - 1 bounds");
+
+            for (size_type i = 1; i < this->bounds.size(); ++i) {
+                if (!(this->bounds[i - 1] < this->bounds[i])) throw std::invalid_argument("bounds must ascend");
+            }
+        }
+
+        ShardedAVL(const ShardedAVL &) = delete;
+        ShardedAVL &operator=(const ShardedAVL &) = delete;
+
+        bool insert(const value_type &value) {
+            return shard(shard_of(value.first)).insert(value);
+        }
+
+        bool insert(value_type &&value) {
+            return shard(shard_of(value.first)).insert(std::move(value));
+        }
+
+        template<typename M>
+        bool insert_or_assign(const key_type &key, M &&obj) {
+            return shard(shard_of(key)).insert_or_assign(key, std::forward<M>(obj));
+        }
+
+        void erase(const key_type &key) {
+            shard(shard_of(key)).erase(key);
+        }
+
+        data_type at(const key_type &key) {
+            return shard(shard_of(key)).at(key);
+        }
+
+        size_type size() {
+            size_type count = 0;
+            for (auto &tmp : this->shards) count += tmp.tree.size();
+
+            return count;
+        }
+
+        // number of keys in [lo, hi)
+        size_type count_range(const key_type &lo, const key_type &hi) {
+            if (!(lo < hi)) return 0;
+
+            size_type count = 0;
+            size_type last = ranged() ? shard_of(hi) : SHARDS - 1;
+
+            for (size_type i = ranged() ? shard_of(lo) : 0; i <= last; ++i) count += shard(i).count_range(lo, hi);
+
+            return count;
+        }
+
+        iterator begin() {
+            iterator tmp;
+
+            for (size_type i = 0; i < SHARDS; ++i) tmp.add(i, shard(i).begin(), shard(i).end());
+
+            return tmp;
+        }
+
+        iterator end() {
+            return iterator();
+        }
+
+        // the first key not below key, or end()
+        iterator lower_bound(const key_type &key) {
+            iterator tmp;
+
+            for (size_type i = ranged() ? shard_of(key) : 0; i < SHARDS; ++i) {
+                tmp.add(i, shard(i).lower_bound(key), shard(i).end());
+            }
+
+            return tmp;
+        }
+
+        bool ranged() const {
+            return !this->bounds.empty();
+        }
+
+        size_type shard_of(const key_type &key) const {
+            if (ranged()) return std::upper_bound(this->bounds.begin(), this->bounds.end(), key) - this->bounds.begin();
+
+            // std::hash of an integer is usually the integer itself, its bits are mixed before the modulo
+            std::size_t tmp = std::hash<key_type>()(key);
+            tmp ^= tmp >> 16;
+            tmp *= 0x45d9f3bU;
+            tmp ^= tmp >> 16;
+
+            return tmp % SHARDS;
+        }
+
+        tree_type& shard(size_type index) {
+            return this->shards[index].tree;
+        }
+
+    private:
+        // a cache line each, or neighbouring shards would bounce their locks between cores
+        struct alignas(64) Shard {
+            tree_type tree;
+        };
+
+        std::array<Shard, SHARDS> shards;
+        std::vector<key_type> bounds;
+    };
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <exception>
+#include <shared_mutex>
+
+namespace AVLtree {
+    // Flat-combining write path for a tree. A writer doesn't take the tree's lock itself: it publishes its
+    // request in a slot of its own and waits. Whichever waiter wins the combiner flag collects every pending
+    // request, sorts them by key so consecutive ones descend the same path, applies the whole batch under one
+    // acquisition of the tree's exclusive lock and hands each writer its result. Under many writers the lock
+    // and the tree stay in one core's cache instead of moving with every write.
+    // Readers keep using the tree directly, and writes through the tree itself stay correct, just uncombined.
+    // A write that throws in the combiner throws in its own writer, the rest of the batch is unaffected.
+    // The tree must outlive the combiner.
+    template<typename TREE>
+    class Combiner {
+    public:
+        using key_type = typename TREE::key_type;
+        using data_type = typename TREE::data_type;
+        using value_type = typename TREE::value_type;
+        using size_type = std::size_t;
+
+        explicit Combiner(TREE &tree) : tree(&tree), combining(false) {
+            for (Slot &tmp : this->slots) tmp.state.store(FREE, std::memory_order_relaxed);
+            // so collecting a batch never allocates
+            this->batch.reserve(SLOTS);
+        }
+
+        Combiner(const Combiner &) = delete;
+        Combiner &operator=(const Combiner &) = delete;
+
+        bool insert(const value_type &value) {
+            Slot &slot = claim();
+            slot.op = INSERT;
+            slot.key = &value.first;
+            slot.value = &value;
+
+            return publish(slot);
+        }
+
+        // Returns true if a new node was linked, false if an existing value was overwritten.
+        bool insert_or_assign(const key_type &key, const data_type &obj) {
+            Slot &slot = claim();
+            slot.op = ASSIGN;
+            slot.key = &key;
+            slot.data = &obj;
+
+            return publish(slot);
+        }
+
+        void erase(const key_type &key) {
+            Slot &slot = claim();
+            slot.op = ERASE;
+            slot.key = &key;
+
+            publish(slot);
+        }
+
+        size_type size() {
+            return this->tree->size();
+        }
+
+    private:
+        // more writers than slots just wait for one to come free
+        static const size_type SLOTS = 64;
+
+        enum ops : unsigned char { INSERT, ASSIGN, ERASE };
+        enum slot_states : unsigned char { FREE, CLAIMED, PENDING, DONE };
+
+        // The request only points at its arguments, the writer waits on them. A cache line each, or a
+        // writer spinning on its slot would keep stealing the line of its neighbours.
+        struct alignas(64) Slot {
+            std::atomic<unsigned char> state;
+            ops op;
+            bool result;
+            // what the write threw, rethrown in its writer
+            std::exception_ptr failure;
+            const key_type *key;
+            const value_type *value;
+            const data_type *data;
+        };
+
+        // starts at a slot picked by thread, so a thread usually gets the same one back
+        Slot& claim() {
+            thread_local size_type home = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+            for (size_type i = home % SLOTS;; i = (i + 1) % SLOTS) {
+                unsigned char expected = FREE;
+                if (this->slots[i].state.compare_exchange_strong(expected, CLAIMED, std::memory_order_acquire)) {
+                    return this->slots[i];
+                }
+
+                if (i == SLOTS - 1) std::this_thread::yield();
+            }
+        }
+
+        // waits until some combiner, maybe this thread, has applied the request
+        bool publish(Slot &slot) {
+            slot.state.store(PENDING, std::memory_order_release);
+
+            while (slot.state.load(std::memory_order_acquire) != DONE) {
+                if ((!this->combining.load(std::memory_order_relaxed)) &&
+                    (!this->combining.exchange(true, std::memory_order_acquire))) {
+                    try {
+                        combine();
+                    }
+                    catch (...) {
+                        // the slots still pending go to the next combiner
+                        this->combining.store(false, std::memory_order_release);
+                        throw;
+                    }
+
+                    this->combining.store(false, std::memory_order_release);
+                }
+                else std::this_thread::yield();
+            }
+
+            bool result = slot.result;
+            std::exception_ptr failure = slot.failure;
+            slot.failure = nullptr;
+            slot.state.store(FREE, std::memory_order_release);
+
+            if (failure) std::rethrow_exception(failure);
+            return result;
+        }
+
+        // only ever run by the thread holding the combiner flag
+        void combine() {
+            this->batch.clear();
+            for (Slot &tmp : this->slots) {
+                if (tmp.state.load(std::memory_order_acquire) == PENDING) this->batch.push_back(&tmp);
+            }
+
+            if (this->batch.empty()) return;
+
+            // a comparison that throws only costs the order, that write fails on its own below
+            try {
+                std::sort(this->batch.begin(), this->batch.end(), [](const Slot *a, const Slot *b) {
+                    return *a->key < *b->key;
+                });
+            }
+            catch (...) {}
+
+            {
+                std::unique_lock<std::shared_mutex> guard(this->tree->mutex);
+
+                for (Slot *tmp : this->batch) {
+                    try {
+                        if (tmp->op == INSERT) tmp->result = this->tree->add(*tmp->value);
+                        else if (tmp->op == ASSIGN) tmp->result = this->tree->store(*tmp->key, *tmp->data);
+                        else {
+                            this->tree->drop(*tmp->key);
+                            tmp->result = false;
+                        }
+                    }
+                    catch (...) {
+                        tmp->result = false;
+                        tmp->failure = std::current_exception();
+                    }
+                }
+            }
+
+            for (Slot *tmp : this->batch) tmp->state.store(DONE, std::memory_order_release);
+        }
+
+        TREE *tree;
+        Slot slots[SLOTS];
+        std::atomic<bool> combining;
+        std::vector<Slot*> batch;
+    };
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AVLtree {
+    // Epoch-based reclamation shared by every tree in the process. A reader pins the current epoch with an
+    // Epoch::Guard for as long as it holds raw node pointers; a writer retires the nodes it unlinks, and they
+    // are freed only once the global epoch has moved two steps past the retire, i.e. once every thread that
+    // could still see them has left its critical section.
+    class Epoch {
+    public:
+        class Guard {
+        public:
+            Guard() {
+                Epoch::enter();
+            }
+
+            ~Guard() {
+                Epoch::leave();
+            }
+
+            Guard(const Guard &) = delete;
+            Guard &operator=(const Guard &) = delete;
+        };
+
+        template<typename T>
+        static void retire(T *ptr) {
+            retire(ptr, [](void *tmp) { delete static_cast<T*>(tmp); });
+        }
+
+        static void retire(void *ptr, void (*deleter)(void*)) {
+            Record *rec = local();
+            std::uint64_t epoch = global().load();
+            std::size_t bucket = epoch % 3;
+
+            if (rec->limbo_epoch[bucket] != epoch) {
+                free_all(rec->limbo[bucket]);
+                rec->limbo_epoch[bucket] = epoch;
+            }
+
+            rec->limbo[bucket].push_back(Retired{ ptr, deleter });
+
+            if (++rec->retired_count % COLLECT_PERIOD == 0) {
+                try_advance();
+                collect(rec);
+            }
+        }
+
+        // Blocks until everything retired so far by this thread has been freed.
+        // Must not be called from inside a Guard.
+        static void synchronize() {
+            std::uint64_t target = global().load() + 2;
+
+            while (global().load() < target) {
+                if (!try_advance()) std::this_thread::yield();
+            }
+
+            collect(local());
+        }
+
+    private:
+        static const std::uint64_t ACTIVE = 1;
+        static const std::size_t COLLECT_PERIOD = 64;
+
+        struct Retired {
+            void *ptr;
+            void (*deleter)(void*);
+        };
+
+        struct Record {
+            // (epoch << 1) | ACTIVE while pinned, 0 otherwise
+            std::atomic<std::uint64_t> state{ 0 };
+            std::atomic<bool> in_use{ false };
+            Record *next = nullptr;
+
+            std::size_t nesting = 0;
+            std::size_t retired_count = 0;
+            std::vector<Retired> limbo[3];
+            std::uint64_t limbo_epoch[3] = {};
+        };
+
+        // gives the record back when the thread exits, its pending nodes go to the orphan list
+        struct Handle {
+            ~Handle() {
+                if (this->rec == nullptr) return;
+
+                {
+                    std::lock_guard<std::mutex> guard(orphans().mutex);
+                    for (std::size_t i = 0; i < 3; ++i) {
+                        for (auto &tmp : this->rec->limbo[i]) orphans().list.push_back(Orphan{ this->rec->limbo_epoch[i], tmp });
+                        this->rec->limbo[i].clear();
+                    }
+                }
+
+                this->rec->retired_count = 0;
+                this->rec->in_use.store(false);
+            }
+
+            Record *rec = nullptr;
+        };
+
+        struct Orphan {
+            std::uint64_t epoch;
+            Retired item;
+        };
+
+        // whatever is left when the process exits can be freed unconditionally
+        struct Orphans {
+            ~Orphans() {
+                for (auto &tmp : this->list) tmp.item.deleter(tmp.item.ptr);
+
+                Record *rec = records().exchange(nullptr);
+                while (rec != nullptr) {
+                    Record *next = rec->next;
+                    for (std::size_t i = 0; i < 3; ++i) free_all(rec->limbo[i]);
+                    delete rec;
+                    rec = next;
+                }
+            }
+
+            std::mutex mutex;
+            std::vector<Orphan> list;
+        };
+
+        static std::atomic<std::uint64_t>& global() {
+            static std::atomic<std::uint64_t> epoch{ 1 };
+            return epoch;
+        }
+
+        static std::atomic<Record*>& records() {
+            static std::atomic<Record*> head{ nullptr };
+            return head;
+        }
+
+        static Orphans& orphans() {
+            static Orphans list;
+            return list;
+        }
+
+        static Record* local() {
+            static thread_local Handle handle;
+            if (handle.rec != nullptr) return handle.rec;
+
+            orphans();
+            for (Record *tmp = records().load(); tmp != nullptr; tmp = tmp->next) {
+                bool expected = false;
+                if (tmp->in_use.compare_exchange_strong(expected, true)) {
+                    handle.rec = tmp;
+                    return tmp;
+                }
+            }
+
+            Record *rec = new Record;
+            rec->in_use = true;
+            rec->next = records().load();
+            while (!records().compare_exchange_weak(rec->next, rec));
+
+            handle.rec = rec;
+            return rec;
+        }
+
+        static void enter() {
+            Record *rec = local();
+            if (rec->nesting++ != 0) return;
+
+            // the epoch may move on between reading it and publishing it, so publish until they agree
+            std::uint64_t epoch = global().load();
+            while (true) {
+                rec->state.store((epoch << 1) | ACTIVE);
+                std::uint64_t now = global().load();
+                if (now == epoch) break;
+                epoch = now;
+            }
+        }
+
+        static void leave() {
+            Record *rec = local();
+            if (--rec->nesting == 0) rec->state.store(0, std::memory_order_release);
+        }
+
+        // moves the global epoch forward if every pinned thread has already seen the current one
+        static bool try_advance() {
+            std::uint64_t epoch = global().load();
+
+            for (Record *tmp = records().load(); tmp != nullptr; tmp = tmp->next) {
+                std::uint64_t state = tmp->state.load();
+                if ((state & ACTIVE) && ((state >> 1) != epoch)) return false;
+            }
+
+            return global().compare_exchange_strong(epoch, epoch + 1);
+        }
+
+        static void collect(Record *rec) {
+            std::uint64_t epoch = global().load();
+
+            for (std::size_t i = 0; i < 3; ++i) {
+                if (rec->limbo_epoch[i] + 2 <= epoch) free_all(rec->limbo[i]);
+            }
+
+            std::vector<Orphan> ready;
+            {
+                std::lock_guard<std::mutex> guard(orphans().mutex);
+                std::vector<Orphan> &list = orphans().list;
+
+                for (std::size_t i = 0; i < list.size();) {
+                    if (list[i].epoch + 2 <= epoch) {
+                        ready.push_back(list[i]);
+                        list[i] = list.back();
+                        list.pop_back();
+                    }
+                    else ++i;
+                }
+            }
+
+            for (auto &tmp : ready) tmp.item.deleter(tmp.item.ptr);
+        }
+
+        static void free_all(std::vector<Retired> &list) {
+            for (auto &tmp : list) tmp.deleter(tmp.ptr);
+            list.clear();
+        }
+    };
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <xmmintrin.h>
+#endif
+
+namespace AVLtree {
+    // Walks a FrozenIndex in key order. The index must outlive it.
+    template<typename KEY, typename DATA>
+    class FrozenIterator {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA>
+        friend class FrozenIndex;
+
+        FrozenIterator() noexcept : keys(nullptr), values(nullptr), size(0), index(0) {}
+
+        key_type get_key() const {
+            return this->keys[this->index];
+        }
+
+        data_type get_value() const {
+            return this->values[this->index];
+        }
+
+        bool operator==(const FrozenIterator &right) const {
+            return this->index == right.index;
+        }
+
+        bool operator!=(const FrozenIterator &right) const {
+            return this->index != right.index;
+        }
+
+        // postfix ++
+        FrozenIterator operator++(int) {
+            FrozenIterator tmp = *this;
+            plus();
+
+            return tmp;
+        }
+
+        // prefix ++
+        FrozenIterator& operator++() {
+            return plus();
+        }
+
+    protected:
+        FrozenIterator(const key_type *k, const data_type *v, size_type n, size_type i) noexcept : keys(k), values(v),
+            size(n), index(i) {}
+
+        // the leftmost node of the right subtree, or the first ancestor reached from the left
+        FrozenIterator& plus() {
+            if (this->index == 0) return *this;
+
+            if (2 * this->index + 1 <= this->size) {
+                this->index = 2 * this->index + 1;
+                while (2 * this->index <= this->size) this->index = 2 * this->index;
+            }
+            else {
+                while (this->index & 1) this->index >>= 1;
+                this->index >>= 1;
+            }
+
+            return *this;
+        }
+
+        const key_type *keys;
+        const data_type *values;
+        size_type size;
+        // slot in the layout, 0 is end()
+        size_type index;
+    };
+
+    // Read-only copy of a tree laid out in Eytzinger order: the implicit binary tree of a heap, node i at slot
+    // i and its children at 2i and 2i + 1. The top levels of every search share a few cache lines, and one
+    // prefetch loads the node four levels down for int keys. The search doesn't branch on the comparison:
+    // it always descends to a leaf, then undoes the moves made after the answer.
+    // Keys and values live apart, so a search touches keys only.
+    template<typename KEY, typename DATA>
+    class FrozenIndex {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using iterator = FrozenIterator<key_type, data_type>;
+        using size_type = std::size_t;
+
+        FrozenIndex() : keys(1), values(1) {}
+
+        // takes pairs sorted by key, without duplicates
+        explicit FrozenIndex(std::vector<std::pair<key_type, data_type>> sorted) : keys(sorted.size() + 1),
+            values(sorted.size() + 1) {
+            size_type next = 0;
+            lay_out(sorted, 1, next);
+        }
+
+        iterator begin() const {
+            if (size() == 0) return end();
+
+            size_type tmp = 1;
+            while (2 * tmp <= size()) tmp = 2 * tmp;
+
+            return make_iterator(tmp);
+        }
+
+        iterator end() const {
+            return make_iterator(0);
+        }
+
+        data_type at(const key_type &key) const {
+            size_type tmp = search(key, false);
+
+            if ((tmp == 0) || (key < this->keys[tmp])) throw std::out_of_range("key out of range");
+            return this->values[tmp];
+        }
+
+        // the first key not below key, or end()
+        iterator lower_bound(const key_type &key) const {
+            return make_iterator(search(key, false));
+        }
+
+        // the first key above key, or end()
+        iterator upper_bound(const key_type &key) const {
+            return make_iterator(search(key, true));
+        }
+
+        size_type size() const {
+            return this->keys.size() - 1;
+        }
+
+    private:
+        // slot i * PREFETCH starts the run of i's descendants a few levels down that fills one cache line
+        static const size_type PREFETCH = (sizeof(key_type) >= 64) ? 1 : 64 / sizeof(key_type);
+
+        static void prefetch(const void *ptr) {
+#ifdef _WIN32
+            _mm_prefetch(static_cast<const char*>(ptr), _MM_HINT_T0);
+#else
+            __builtin_prefetch(ptr);
+#endif
+        }
+
+        // in-order walk of the implicit tree, hands out the sorted pairs one by one
+        void lay_out(std::vector<std::pair<key_type, data_type>> &sorted, size_type slot, size_type &next) {
+            if (slot > size()) return;
+
+            lay_out(sorted, 2 * slot, next);
+            this->keys[slot] = std::move(sorted[next].first);
+            this->values[slot] = std::move(sorted[next].second);
+            next++;
+            lay_out(sorted, 2 * slot + 1, next);
+        }
+
+        // slot of the first key not below key, or above it if strict; 0 if there is none
+        size_type search(const key_type &key, bool strict) const {
+            const key_type *base = this->keys.data();
+            size_type n = size();
+            size_type tmp = 1;
+
+            // the address is only a hint, it may point past the end
+            while (tmp <= n) {
+                prefetch(reinterpret_cast<const void*>(reinterpret_cast<std::uintptr_t>(base) +
+                    tmp * PREFETCH * sizeof(key_type)));
+
+                if (strict) tmp = 2 * tmp + !(key < base[tmp]);
+                else tmp = 2 * tmp + (base[tmp] < key);
+            }
+
+            // every 1 at the bottom of tmp is a right turn past the answer, the 0 above them the turn onto it
+            while (tmp & 1) tmp >>= 1;
+            return tmp >> 1;
+        }
+
+        iterator make_iterator(size_type slot) const {
+            return iterator(this->keys.data(), this->values.data(), size(), slot);
+        }
+
+        // slot 0 is unused, so children are at 2i and 2i + 1
+        std::vector<key_type> keys;
+        std::vector<data_type> values;
+    };
+}
@@ -0,0 +1,423 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace AVLtree {
+    // First 64 bytes of a snapshot file. The keys follow at keys_offset and the values at values_offset, both
+    // sorted by key and padded to 64 bytes; nothing in the file is a pointer, so it can be mapped at any address.
+    struct MappedHeader {
+        static const std::uint32_t VERSION = 1;
+        // reads back in another order on a machine of the other endianness
+        static const std::uint32_t ENDIAN_MARK = 0x01020304;
+        static const std::size_t ALIGNMENT = 64;
+
+        static const char* magic() {
+            return "AVLSNAP";
+        }
+
+        // FNV-1a, continued from hash
+        static std::uint64_t checksum(const void *ptr, std::size_t size, std::uint64_t hash = 14695981039346656037ULL) {
+            const unsigned char *bytes = static_cast<const unsigned char*>(ptr);
+            for (std::size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+
+            return hash;
+        }
+
+        static std::uint64_t align(std::uint64_t size) {
+            return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        }
+
+        char tag[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::uint32_t key_size;
+        std::uint32_t data_size;
+        std::uint64_t count;
+        std::uint64_t keys_offset;
+        std::uint64_t values_offset;
+        // of every byte from keys_offset to the end of the file
+        std::uint64_t checksum_;
+        std::uint64_t reserved;
+    };
+
+    static_assert(sizeof(MappedHeader) == MappedHeader::ALIGNMENT, "the keys start one header past the file's start");
+
+    // Walks a MappedIndex in key order. The index must outlive it.
+    template<typename KEY, typename DATA>
+    class MappedIterator {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA>
+        friend class MappedIndex;
+
+        MappedIterator() noexcept : keys(nullptr), values(nullptr), index(0) {}
+
+        key_type get_key() const {
+            return this->keys[this->index];
+        }
+
+        data_type get_value() const {
+            return this->values[this->index];
+        }
+
+        bool operator==(const MappedIterator &right) const {
+            return this->index == right.index;
+        }
+
+        bool operator!=(const MappedIterator &right) const {
+            return this->index != right.index;
+        }
+
+        // postfix ++
+        MappedIterator operator++(int) {
+            MappedIterator tmp = *this;
+            ++this->index;
+
+            return tmp;
+        }
+
+        // prefix ++
+        MappedIterator& operator++() {
+            ++this->index;
+            return *this;
+        }
+
+        // postfix --
+        MappedIterator operator--(int) {
+            MappedIterator tmp = *this;
+            --this->index;
+
+            return tmp;
+        }
+
+        // prefix --
+        MappedIterator& operator--() {
+            --this->index;
+            return *this;
+        }
+
+    protected:
+        MappedIterator(const key_type *k, const data_type *v, size_type i) noexcept : keys(k), values(v), index(i) {}
+
+        const key_type *keys;
+        const data_type *values;
+        size_type index;
+    };
+
+    // Read-only view of a snapshot file written by AVL::save. Opening it maps the file and checks the header,
+    // nothing more, so it takes the same time for any size; pages are read in by the OS as lookups touch
+    // them. at and the bounds search the mapped keys in place. verify() reads the whole file to check the
+    // checksum, for when that is worth the time.
+    template<typename KEY, typename DATA>
+    class MappedIndex {
+    public:
+        using key_type = KEY;
+        using data_type = DATA;
+        using value_type = std::pair<const key_type, data_type>;
+        using iterator = MappedIterator<key_type, data_type>;
+        using size_type = std::size_t;
+
+        static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<data_type>::value,
+            "only keys and values that are plain bytes can be read back from a mapping");
+
+        explicit MappedIndex(const std::string &path) : base(nullptr), length(0), keys(nullptr), values(nullptr),
+            count(0) {
+            map(path);
+
+            if (this->length < sizeof(MappedHeader)) fail("file too short for a snapshot header");
+
+            MappedHeader header;
+            std::memcpy(&header, this->base, sizeof(header));
+
+            if (std::memcmp(header.tag, MappedHeader::magic(), sizeof(header.tag)) != 0) fail("not a snapshot file");
+            if (header.version != MappedHeader::VERSION) fail("unsupported snapshot version");
+            if (header.byte_order != MappedHeader::ENDIAN_MARK) fail("snapshot written with another byte order");
+            if ((header.key_size != sizeof(key_type)) || (header.data_size != sizeof(data_type))) {
+                fail("snapshot written for other key or value types");
+            }
+
+            // count is at most length, so the sizes can't wrap; the offsets can, so they are compared apart
+            if ((header.count > this->length) || (header.keys_offset < sizeof(MappedHeader)) ||
+                (!fits(header.keys_offset, header.count * sizeof(key_type))) ||
+                (!fits(header.values_offset, header.count * sizeof(data_type)))) {
+                fail("snapshot file truncated");
+            }
+
+            if ((header.keys_offset % alignof(key_type) != 0) || (header.values_offset % alignof(data_type) != 0)) {
+                fail("snapshot keys or values misaligned");
+            }
+
+            this->keys = reinterpret_cast<const key_type*>(this->base + header.keys_offset);
+            this->values = reinterpret_cast<const data_type*>(this->base + header.values_offset);
+            this->count = static_cast<size_type>(header.count);
+            this->checksum = header.checksum_;
+            this->payload = header.keys_offset;
+        }
+
+        MappedIndex(MappedIndex &&tmp) : base(tmp.base), length(tmp.length), keys(tmp.keys), values(tmp.values),
+            count(tmp.count), checksum(tmp.checksum), payload(tmp.payload) {
+#ifdef _WIN32
+            this->file = tmp.file;
+            this->mapping = tmp.mapping;
+            tmp.file = INVALID_HANDLE_VALUE;
+            tmp.mapping = nullptr;
+#endif
+            tmp.base = nullptr;
+            tmp.length = 0;
+        }
+
+        MappedIndex(const MappedIndex &) = delete;
+        MappedIndex &operator=(const MappedIndex &) = delete;
+        MappedIndex &operator=(MappedIndex &&) = delete;
+
+        ~MappedIndex() {
+            unmap();
+        }
+
+        // Writes a snapshot file. walk(fn) must call fn(pair) for every pair in key order, it is called twice:
+        // once for the keys and once for the values. The file is written beside path, synced, renamed over it
+        // and the directory synced too, so a crash leaves either the old snapshot or the new one.
+        template<typename WALK>
+        static void write(const std::string &path, size_type count, WALK walk) {
+            std::string tmp_path = path + ".tmp";
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!out) throw std::runtime_error("can't create " + tmp_path);
+
+            MappedHeader header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.tag, MappedHeader::magic(), sizeof(header.tag));
+            header.version = MappedHeader::VERSION;
+            header.byte_order = MappedHeader::ENDIAN_MARK;
+            header.key_size = sizeof(key_type);
+            header.data_size = sizeof(data_type);
+            header.count = count;
+            header.keys_offset = sizeof(MappedHeader);
+            header.values_offset = header.keys_offset + MappedHeader::align(count * sizeof(key_type));
+
+            std::uint64_t hash = MappedHeader::checksum(nullptr, 0);
+            size_type written = 0;
+            char zeros[MappedHeader::ALIGNMENT] = {};
+
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+            auto put = [&](const void *ptr, std::size_t size) {
+                out.write(static_cast<const char*>(ptr), size);
+                hash = MappedHeader::checksum(ptr, size, hash);
+            };
+
+            walk([&](const value_type &value) {
+                put(&value.first, sizeof(key_type));
+                written++;
+            });
+
+            if (written != count) throw std::logic_error("walk passed another number of pairs than count");
+            put(zeros, static_cast<std::size_t>(header.values_offset - header.keys_offset - count * sizeof(key_type)));
+
+            walk([&](const value_type &value) {
+                put(&value.second, sizeof(data_type));
+            });
+
+            put(zeros, static_cast<std::size_t>(MappedHeader::align(count * sizeof(data_type)) - count * sizeof(data_type)));
+
+            header.checksum_ = hash;
+            out.seekp(0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.close();
+
+            if (!out) throw std::runtime_error("can't write " + tmp_path);
+
+            // without it the rename can reach the disk before the data, and a crash leaves an empty file at path
+            if (!sync_file(tmp_path)) throw std::runtime_error("can't sync " + tmp_path);
+
+#ifdef _WIN32
+            // replaces path in one step, and returns only once the move is on disk
+            if (!MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+                throw std::runtime_error("can't rename to " + path);
+#else
+            if (std::rename(tmp_path.c_str(), path.c_str()) != 0) throw std::runtime_error("can't rename to " + path);
+
+            // the rename lives in the directory, which has to reach the disk as well
+            if (!sync_directory(path)) throw std::runtime_error("can't sync the directory of " + path);
+#endif
+        }
+
+        iterator begin() const {
+            return make_iterator(0);
+        }
+
+        iterator end() const {
+            return make_iterator(this->count);
+        }
+
+        data_type at(const key_type &key) const {
+            const key_type *tmp = std::lower_bound(this->keys, this->keys + this->count, key);
+
+            if ((tmp == this->keys + this->count) || (key < *tmp)) throw std::out_of_range("key out of range");
+            return this->values[tmp - this->keys];
+        }
+
+        // the first key not below key, or end()
+        iterator lower_bound(const key_type &key) const {
+            return make_iterator(std::lower_bound(this->keys, this->keys + this->count, key) - this->keys);
+        }
+
+        // the first key above key, or end()
+        iterator upper_bound(const key_type &key) const {
+            return make_iterator(std::upper_bound(this->keys, this->keys + this->count, key) - this->keys);
+        }
+
+        // number of keys in [lo, hi)
+        size_type count_range(const key_type &lo, const key_type &hi) const {
+            if (!(lo < hi)) return 0;
+            return lower_bound(hi).index - lower_bound(lo).index;
+        }
+
+        size_type size() const {
+            return this->count;
+        }
+
+        // reads every page, true if the file still holds what was saved
+        bool verify() const {
+            return MappedHeader::checksum(this->base + this->payload, this->length - this->payload) == this->checksum;
+        }
+
+    private:
+        iterator make_iterator(size_type index) const {
+            return iterator(this->keys, this->values, index);
+        }
+
+        void fail(const char *what) {
+            unmap();
+            throw std::runtime_error(what);
+        }
+
+        // whether size bytes at offset lie inside the file, without offset + size wrapping around
+        bool fits(std::uint64_t offset, std::uint64_t size) const {
+            return (offset <= this->length) && (size <= this->length - offset);
+        }
+
+#ifdef _WIN32
+        static bool sync_file(const std::string &path) {
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                nullptr);
+            if (file == INVALID_HANDLE_VALUE) return false;
+
+            bool ok = FlushFileBuffers(file) != 0;
+            CloseHandle(file);
+
+            return ok;
+        }
+
+        void map(const std::string &path) {
+            this->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (this->file == INVALID_HANDLE_VALUE) throw std::runtime_error("can't open " + path);
+
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(this->file, &size) || (size.QuadPart == 0)) fail("can't map an empty file");
+            this->length = static_cast<std::size_t>(size.QuadPart);
+
+            this->mapping = CreateFileMappingA(this->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (this->mapping == nullptr) fail("can't map the snapshot file");
+
+            this->base = static_cast<const char*>(MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0));
+            if (this->base == nullptr) fail("can't map the snapshot file");
+        }
+
+        void unmap() {
+            if (this->base != nullptr) UnmapViewOfFile(this->base);
+            if (this->mapping != nullptr) CloseHandle(this->mapping);
+            if (this->file != INVALID_HANDLE_VALUE) CloseHandle(this->file);
+
+            this->base = nullptr;
+            this->mapping = nullptr;
+            this->file = INVALID_HANDLE_VALUE;
+        }
+
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        static bool sync_file(const std::string &path) {
+            int fd = ::open(path.c_str(), O_WRONLY);
+            if (fd < 0) return false;
+
+            bool ok = fsync(fd) == 0;
+            ::close(fd);
+
+            return ok;
+        }
+
+        static bool sync_directory(const std::string &path) {
+            std::string::size_type slash = path.find_last_of('/');
+            std::string dir = (slash == std::string::npos) ? "." : path.substr(0, (slash == 0) ? 1 : slash);
+
+            int fd = ::open(dir.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            bool ok = fsync(fd) == 0;
+            ::close(fd);
+
+            return ok;
+        }
+
+        void map(const std::string &path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw std::runtime_error("can't open " + path);
+
+            struct stat info;
+            if ((fstat(fd, &info) != 0) || (info.st_size == 0)) {
+                ::close(fd);
+                throw std::runtime_error("can't map an empty file");
+            }
+
+            this->length = static_cast<std::size_t>(info.st_size);
+            void *ptr = mmap(nullptr, this->length, PROT_READ, MAP_SHARED, fd, 0);
+
+            // the mapping keeps the file alive by itself
+            ::close(fd);
+            if (ptr == MAP_FAILED) throw std::runtime_error("can't map " + path);
+
+            this->base = static_cast<const char*>(ptr);
+        }
+
+        void unmap() {
+            if (this->base != nullptr) munmap(const_cast<char*>(this->base), this->length);
+            this->base = nullptr;
+        }
+#endif
+
+        const char *base;
+        std::size_t length;
+
+        const key_type *keys;
+        const data_type *values;
+        size_type count;
+
+        std::uint64_t checksum = 0;
+        // offset of the checksummed bytes
+        std::uint64_t payload = 0;
+    };
+}
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace AVLtree {
+    // Node memory straight from the global heap, one malloc per node.
+    class HeapAllocator {
+    public:
+        static const bool bulk_release = false;
+
+        void* allocate(std::size_t size) {
+            return ::operator new(size);
+        }
+
+        static void deallocate(void *ptr, std::size_t) {
+            ::operator delete(ptr);
+        }
+
+        // malloc's own header and rounding aren't counted
+        static std::size_t footprint(std::size_t size) {
+            return size;
+        }
+
+        void release() {}
+    };
+
+    // Size-class slabs carved out of CHUNK_SIZE-aligned chunks. Every chunk starts with a header that names
+    // its owner, so deallocate() finds the arena from the pointer alone. Each thread keeps a small free cache
+    // for each of the last few arenas it used, and the arena hands out and takes back slots in batches, so node
+    // churn doesn't touch the global heap, not even when a thread works on several trees in turn. Destroying
+    // the arena frees whole chunks, not nodes.
+    class SlabAllocator {
+    public:
+        static const bool bulk_release = true;
+
+        SlabAllocator() : chunks(nullptr), reserved(0), in_use(0) {
+            std::lock_guard<std::mutex> guard(registry_mutex());
+            this->id = ++last_id();
+            this->next_alive = registry();
+            registry() = this;
+        }
+
+        SlabAllocator(const SlabAllocator &) = delete;
+        SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+        ~SlabAllocator() {
+            std::lock_guard<std::mutex> guard(registry_mutex());
+            SlabAllocator **tmp = &registry();
+            while (*tmp != this) tmp = &(*tmp)->next_alive;
+            *tmp = this->next_alive;
+
+            free_chunks();
+        }
+
+        void* allocate(std::size_t size) {
+            if (size > MAX_SIZE) return ::operator new(size);
+
+            std::size_t size_class = class_of(size);
+            ThreadCache &cache = thread_cache(this);
+
+            if (cache.head[size_class] == nullptr) refill(cache, size_class);
+
+            Slot *slot = cache.head[size_class];
+            cache.head[size_class] = slot->next;
+            cache.count[size_class]--;
+            this->in_use.fetch_add(slot_size(size_class), std::memory_order_relaxed);
+
+            return slot;
+        }
+
+        static void deallocate(void *ptr, std::size_t size) {
+            if (ptr == nullptr) return;
+            if (size > MAX_SIZE) {
+                ::operator delete(ptr);
+                return;
+            }
+
+            std::size_t size_class = class_of(size);
+            SlabAllocator *owner = chunk_of(ptr)->owner;
+            ThreadCache *cache = cached(owner);
+            Slot *slot = static_cast<Slot*>(ptr);
+
+            owner->in_use.fetch_sub(slot_size(size_class), std::memory_order_relaxed);
+
+            if (cache != nullptr) {
+                slot->next = cache->head[size_class];
+                cache->head[size_class] = slot;
+                cache->count[size_class]++;
+
+                if (cache->count[size_class] > CACHE_SIZE) owner->drain(*cache, size_class, CACHE_SIZE / 2);
+
+                return;
+            }
+
+            // no cache of this arena here: straight to its free list, caches of other arenas stay as they are
+            std::lock_guard<std::mutex> guard(owner->classes[size_class].mutex);
+            slot->next = owner->classes[size_class].free;
+            owner->classes[size_class].free = slot;
+        }
+
+        // Gives every chunk back at once; all memory handed out by this arena becomes invalid.
+        void release() {
+            std::lock_guard<std::mutex> guard(registry_mutex());
+            free_chunks();
+            this->id = ++last_id();
+        }
+
+        std::size_t bytes_reserved() const {
+            return this->reserved.load(std::memory_order_relaxed);
+        }
+
+        std::size_t bytes_in_use() const {
+            return this->in_use.load(std::memory_order_relaxed);
+        }
+
+        // what one allocation of size really takes, rounded up to its slot
+        static std::size_t footprint(std::size_t size) {
+            return (size > MAX_SIZE) ? size : slot_size(class_of(size));
+        }
+
+    private:
+        static const std::size_t CHUNK_SIZE = 1 << 16;
+        static const std::size_t HEADER_SIZE = 64;
+        static const std::size_t GRANULARITY = 16;
+        static const std::size_t CLASSES = 16;
+        static const std::size_t MAX_SIZE = GRANULARITY * CLASSES;
+        static const std::size_t CACHE_SIZE = 64;
+        static const std::size_t CACHED_ARENAS = 4;
+
+        struct Slot {
+            Slot *next;
+        };
+
+        struct Chunk {
+            SlabAllocator *owner;
+            Chunk *next;
+        };
+
+        struct SizeClass {
+            std::mutex mutex;
+            Slot *free = nullptr;
+            char *cursor = nullptr;
+            char *limit = nullptr;
+        };
+
+        struct ThreadCache {
+            ~ThreadCache() {
+                detach();
+            }
+
+            // hands the cached slots back to their arena if it is still alive, otherwise just forgets them
+            void detach() {
+                if (this->owner != nullptr) {
+                    std::lock_guard<std::mutex> guard(registry_mutex());
+
+                    if (alive(this->owner, this->owner_id)) {
+                        for (std::size_t i = 0; i < CLASSES; ++i) this->owner->drain(*this, i, 0);
+                    }
+                }
+
+                this->owner = nullptr;
+                this->owner_id = 0;
+                for (std::size_t i = 0; i < CLASSES; ++i) {
+                    this->head[i] = nullptr;
+                    this->count[i] = 0;
+                }
+            }
+
+            SlabAllocator *owner = nullptr;
+            std::size_t owner_id = 0;
+            Slot *head[CLASSES] = {};
+            std::size_t count[CLASSES] = {};
+            // when this thread last used it, the least recent one goes when another arena needs a cache
+            std::size_t last_use = 0;
+        };
+
+        struct ThreadCaches {
+            ThreadCache caches[CACHED_ARENAS];
+            std::size_t clock = 0;
+        };
+
+        static std::size_t class_of(std::size_t size) {
+            return (size == 0) ? 0 : (size - 1) / GRANULARITY;
+        }
+
+        static std::size_t slot_size(std::size_t size_class) {
+            return (size_class + 1) * GRANULARITY;
+        }
+
+        static Chunk* chunk_of(void *ptr) {
+            return reinterpret_cast<Chunk*>(reinterpret_cast<std::uintptr_t>(ptr) & ~(std::uintptr_t)(CHUNK_SIZE - 1));
+        }
+
+        static ThreadCaches& thread_caches() {
+            static thread_local ThreadCaches caches;
+            return caches;
+        }
+
+        // this thread's cache of arena, or nullptr if it has none
+        static ThreadCache* cached(SlabAllocator *arena) {
+            ThreadCaches &tmp = thread_caches();
+
+            for (std::size_t i = 0; i < CACHED_ARENAS; ++i) {
+                ThreadCache &cache = tmp.caches[i];
+
+                if ((cache.owner == arena) && (cache.owner_id == arena->id)) {
+                    cache.last_use = ++tmp.clock;
+                    return &cache;
+                }
+            }
+
+            return nullptr;
+        }
+
+        // this thread's cache of arena, taking over the least recently used one if it has none yet
+        static ThreadCache& thread_cache(SlabAllocator *arena) {
+            ThreadCache *cache = cached(arena);
+            if (cache != nullptr) return *cache;
+
+            ThreadCaches &tmp = thread_caches();
+            cache = &tmp.caches[0];
+            for (std::size_t i = 1; i < CACHED_ARENAS; ++i) {
+                if (tmp.caches[i].last_use < cache->last_use) cache = &tmp.caches[i];
+            }
+
+            cache->detach();
+            cache->owner = arena;
+            cache->owner_id = arena->id;
+            cache->last_use = ++tmp.clock;
+
+            return *cache;
+        }
+
+        static std::mutex& registry_mutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static SlabAllocator*& registry() {
+            static SlabAllocator *head = nullptr;
+            return head;
+        }
+
+        static std::size_t& last_id() {
+            static std::size_t id = 0;
+            return id;
+        }
+
+        // registry_mutex must be held
+        static bool alive(SlabAllocator *arena, std::size_t arena_id) {
+            for (SlabAllocator *tmp = registry(); tmp != nullptr; tmp = tmp->next_alive) {
+                if (tmp == arena) return tmp->id == arena_id;
+            }
+
+            return false;
+        }
+
+        static void* aligned_chunk() {
+#ifdef _WIN32
+            void *ptr = _aligned_malloc(CHUNK_SIZE, CHUNK_SIZE);
+#else
+            void *ptr = nullptr;
+            if (posix_memalign(&ptr, CHUNK_SIZE, CHUNK_SIZE) != 0) ptr = nullptr;
+#endif
+            if (ptr == nullptr) throw std::bad_alloc();
+
+            return ptr;
+        }
+
+        static void free_chunk(void *ptr) {
+#ifdef _WIN32
+            _aligned_free(ptr);
+#else
+            free(ptr);
+#endif
+        }
+
+        // moves a batch of slots from the arena into the thread cache, carving a new chunk if needed
+        void refill(ThreadCache &cache, std::size_t size_class) {
+            SizeClass &central = this->classes[size_class];
+            std::size_t size = slot_size(size_class);
+            std::lock_guard<std::mutex> guard(central.mutex);
+
+            while ((central.free != nullptr) && (cache.count[size_class] < CACHE_SIZE / 2)) {
+                Slot *slot = central.free;
+                central.free = slot->next;
+                slot->next = cache.head[size_class];
+                cache.head[size_class] = slot;
+                cache.count[size_class]++;
+            }
+
+            if (cache.head[size_class] != nullptr) return;
+
+            if ((central.cursor == nullptr) || (central.cursor + size > central.limit)) {
+                Chunk *chunk = static_cast<Chunk*>(aligned_chunk());
+                chunk->owner = this;
+                chunk->next = this->chunks.load(std::memory_order_relaxed);
+                while (!this->chunks.compare_exchange_weak(chunk->next, chunk));
+
+                this->reserved.fetch_add(CHUNK_SIZE, std::memory_order_relaxed);
+                central.cursor = reinterpret_cast<char*>(chunk) + HEADER_SIZE;
+                central.limit = reinterpret_cast<char*>(chunk) + CHUNK_SIZE;
+            }
+
+            while ((central.cursor + size <= central.limit) && (cache.count[size_class] < CACHE_SIZE)) {
+                Slot *slot = reinterpret_cast<Slot*>(central.cursor);
+                central.cursor += size;
+                slot->next = cache.head[size_class];
+                cache.head[size_class] = slot;
+                cache.count[size_class]++;
+            }
+        }
+
+        // returns slots from the thread cache to the arena until only keep of them are left
+        void drain(ThreadCache &cache, std::size_t size_class, std::size_t keep) {
+            SizeClass &central = this->classes[size_class];
+            std::lock_guard<std::mutex> guard(central.mutex);
+
+            while (cache.count[size_class] > keep) {
+                Slot *slot = cache.head[size_class];
+                cache.head[size_class] = slot->next;
+                cache.count[size_class]--;
+                slot->next = central.free;
+                central.free = slot;
+            }
+        }
+
+        void free_chunks() {
+            Chunk *chunk = this->chunks.exchange(nullptr);
+
+            while (chunk != nullptr) {
+                Chunk *next = chunk->next;
+                free_chunk(chunk);
+                chunk = next;
+            }
+
+            for (std::size_t i = 0; i < CLASSES; ++i) {
+                this->classes[i].free = nullptr;
+                this->classes[i].cursor = nullptr;
+                this->classes[i].limit = nullptr;
+            }
+
+            this->reserved = 0;
+            this->in_use = 0;
+        }
+
+        std::atomic<Chunk*> chunks;
+        std::atomic<std::size_t> reserved;
+        std::atomic<std::size_t> in_use;
+        SizeClass classes[CLASSES];
+        std::size_t id;
+        SlabAllocator *next_alive;
+    };
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <exception>
+
+namespace AVLtree {
+    // Fork-join pool for divide and conquer. Every worker owns a deque: it pushes and pops its own tasks at
+    // the back, and an idle worker steals the oldest task, the biggest one, from the front of another's.
+    // Threads outside the pool share one more deque. A thread waiting for a forked task runs other tasks
+    // meanwhile instead of blocking, so nested forks can't deadlock. An exception from either half comes out
+    // of invoke(), but only once both halves are done.
+    class ThreadPool {
+    public:
+        // the calling thread always works too, so threads - 1 workers are started
+        explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency()) : queues(threads < 1 ? 1 : threads),
+            pending(0), stop(false) {
+            for (std::size_t i = 0; i + 1 < this->queues.size(); ++i) {
+                this->workers.push_back(std::thread(&ThreadPool::work, this, i));
+            }
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> guard(this->sleep_mutex);
+                this->stop = true;
+            }
+
+            this->wake.notify_all();
+            for (auto &tmp : this->workers) tmp.join();
+        }
+
+        // the pool shared by every tree in the process
+        static ThreadPool& instance() {
+            static ThreadPool pool;
+            return pool;
+        }
+
+        std::size_t size() const {
+            return this->queues.size();
+        }
+
+        // Runs left here and right wherever a thread is free, returns once both are done. If either threw,
+        // rethrows that, left's first.
+        template<typename LEFT, typename RIGHT>
+        void invoke(LEFT &&left, RIGHT &&right) {
+            Task task(right);
+            std::size_t index = own_queue();
+            std::exception_ptr failure;
+
+            push(index, &task);
+
+            // task lives on this stack, so nothing may unwind past it while another thread can still run it
+            try {
+                left();
+            }
+            catch (...) {
+                failure = std::current_exception();
+            }
+
+            while (!task.done.load(std::memory_order_acquire)) {
+                Task *tmp = take(index);
+
+                if (tmp) tmp->run();
+                else std::this_thread::yield();
+            }
+
+            if (failure) std::rethrow_exception(failure);
+            if (task.failure) std::rethrow_exception(task.failure);
+        }
+
+    private:
+        struct Task {
+            template<typename F>
+            explicit Task(F &f) : fn(&Task::call<F>), arg(&f), done(false) {}
+
+            template<typename F>
+            static void call(void *arg) {
+                (*static_cast<F*>(arg))();
+            }
+
+            // never throws: the exception is kept for the thread that forked the task
+            void run() {
+                try {
+                    this->fn(this->arg);
+                }
+                catch (...) {
+                    this->failure = std::current_exception();
+                }
+
+                this->done.store(true, std::memory_order_release);
+            }
+
+            void (*fn)(void*);
+            void *arg;
+            std::atomic<bool> done;
+            std::exception_ptr failure;
+        };
+
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task*> tasks;
+        };
+
+        struct Worker {
+            ThreadPool *pool = nullptr;
+            std::size_t index = 0;
+        };
+
+        static Worker& local() {
+            static thread_local Worker worker;
+            return worker;
+        }
+
+        // a worker's own deque, or the shared one for everybody else
+        std::size_t own_queue() {
+            if (local().pool == this) return local().index;
+            return this->queues.size() - 1;
+        }
+
+        void push(std::size_t index, Task *task) {
+            // counted first, so take() never brings the count below zero
+            this->pending++;
+
+            try {
+                std::lock_guard<std::mutex> guard(this->queues[index].mutex);
+                this->queues[index].tasks.push_back(task);
+            }
+            catch (...) {
+                this->pending--;
+                throw;
+            }
+
+            // taking the lock orders the count before a worker's check, so the wakeup can't be lost
+            { std::lock_guard<std::mutex> guard(this->sleep_mutex); }
+            this->wake.notify_one();
+        }
+
+        // newest task of the thread's own deque first, then the oldest one anybody else has
+        Task* take(std::size_t index) {
+            std::size_t count = this->queues.size();
+
+            for (std::size_t i = 0; i < count; ++i) {
+                Queue &queue = this->queues[(index + i) % count];
+                std::lock_guard<std::mutex> guard(queue.mutex);
+
+                if (queue.tasks.empty()) continue;
+
+                Task *tmp;
+                if (i == 0) {
+                    tmp = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                else {
+                    tmp = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+
+                this->pending--;
+                return tmp;
+            }
+
+            return nullptr;
+        }
+
+        void work(std::size_t index) {
+            local().pool = this;
+            local().index = index;
+
+            while (true) {
+                Task *tmp = take(index);
+
+                if (tmp) {
+                    tmp->run();
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> guard(this->sleep_mutex);
+                this->wake.wait(guard, [this] { return this->stop || (this->pending.load() > 0); });
+
+                if (this->stop) return;
+            }
+        }
+
+        std::vector<Queue> queues;
+        std::vector<std::thread> workers;
+
+        std::atomic<std::size_t> pending;
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+        bool stop;
+    };
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include <shared_mutex>
+
+namespace AVLtree {
+    // Optimistic multi-key transaction on one tree, made by AVL::begin_txn(). Reads go to the tree under its
+    // shared lock, one key at a time, and are remembered with what they saw; writes are only buffered, and
+    // reads of a key written before return the buffered value. commit() takes the exclusive lock once,
+    // checks that every key read still holds what was read, and then applies all writes, so the transaction
+    // takes effect at that one moment or not at all. A value read is its own version: nodes carry no stamp,
+    // and a node's address can't serve as one once the allocator hands it out again, so data_type needs ==.
+    // A transaction touches a handful of keys, its sets are searched linearly.
+    template<typename TREE>
+    class Transaction {
+    public:
+        using key_type = typename TREE::key_type;
+        using data_type = typename TREE::data_type;
+        using size_type = std::size_t;
+
+        template<typename KEY, typename DATA, template<typename> class POINTER, typename ALLOC>
+        friend class AVL;
+
+        // true and the value if key is there
+        bool find(const key_type &key, data_type &value) {
+            Entry *tmp = lookup(this->writes, key);
+            if (tmp == nullptr) tmp = lookup(this->reads, key);
+
+            if (tmp == nullptr) {
+                this->reads.push_back(Entry{ key, false, data_type() });
+                tmp = &this->reads.back();
+
+                std::shared_lock<std::shared_mutex> guard(this->tree->mutex);
+                tmp->present = this->tree->peek(key, tmp->value);
+            }
+
+            if (tmp->present) value = tmp->value;
+            return tmp->present;
+        }
+
+        data_type at(const key_type &key) {
+            data_type tmp;
+            if (find(key, tmp)) return tmp;
+
+            throw std::out_of_range("key out of range");
+        }
+
+        void insert_or_assign(const key_type &key, const data_type &value) {
+            write(key, true, value);
+        }
+
+        void erase(const key_type &key) {
+            write(key, false, data_type());
+        }
+
+        // Returns false, changing nothing, if a key read has changed since; the transaction is empty again
+        // either way and can be rerun from the start.
+        bool commit() {
+            bool valid;
+
+            if (this->writes.empty()) {
+                std::shared_lock<std::shared_mutex> guard(this->tree->mutex);
+                valid = validate();
+            }
+            else {
+                std::unique_lock<std::shared_mutex> guard(this->tree->mutex);
+                valid = validate();
+
+                if (valid) {
+                    for (Entry &tmp : this->writes) {
+                        if (tmp.present) this->tree->store(tmp.key, tmp.value);
+                        else this->tree->drop(tmp.key);
+                    }
+                }
+            }
+
+            abort();
+            return valid;
+        }
+
+        // forgets everything read and written
+        void abort() {
+            this->reads.clear();
+            this->writes.clear();
+        }
+
+        size_type read_count() const {
+            return this->reads.size();
+        }
+
+        size_type write_count() const {
+            return this->writes.size();
+        }
+
+    protected:
+        explicit Transaction(TREE &tree) : tree(&tree) {}
+
+        struct Entry {
+            key_type key;
+            // erased, or absent when read
+            bool present;
+            data_type value;
+        };
+
+        static Entry* lookup(std::vector<Entry> &entries, const key_type &key) {
+            for (Entry &tmp : entries) {
+                if (tmp.key == key) return &tmp;
+            }
+
+            return nullptr;
+        }
+
+        void write(const key_type &key, bool present, const data_type &value) {
+            Entry *tmp = lookup(this->writes, key);
+
+            if (tmp == nullptr) this->writes.push_back(Entry{ key, present, value });
+            else {
+                tmp->present = present;
+                tmp->value = value;
+            }
+        }
+
+        // under the tree's lock
+        bool validate() {
+            data_type now;
+
+            for (Entry &tmp : this->reads) {
+                bool present = this->tree->peek(tmp.key, now);
+
+                if (present != tmp.present) return false;
+                if (present && !(now == tmp.value)) return false;
+            }
+
+            return true;
+        }
+
+        TREE *tree;
+        std::vector<Entry> reads;
+        std::vector<Entry> writes;
+    };
+}
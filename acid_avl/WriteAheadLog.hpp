@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace AVLtree {
+    // Append-only log of opaque records with group commit. append() only copies a record into the pending
+    // batch; commit() waits until the record is on disk. The first waiter to find no write in progress writes
+    // and syncs everything pending, for itself and for every writer that appended meanwhile, so a burst of
+    // concurrent commits costs one fsync, not one each. Every record carries its length and a checksum, and
+    // replay() stops at the first one that doesn't check out: the torn tail of a crash, which it cuts off.
+    class WriteAheadLog {
+    public:
+        explicit WriteAheadLog(const std::string &path) : appended(0), durable(0), flushing(false), broken(false) {
+#ifdef _WIN32
+            this->file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (this->file == INVALID_HANDLE_VALUE) throw std::runtime_error("can't open " + path);
+
+            LARGE_INTEGER size;
+            GetFileSizeEx(this->file, &size);
+            this->appended = static_cast<std::uint64_t>(size.QuadPart);
+            SetFilePointerEx(this->file, size, nullptr, FILE_BEGIN);
+#else
+            this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+            if (this->fd < 0) throw std::runtime_error("can't open " + path);
+
+            this->appended = static_cast<std::uint64_t>(lseek(this->fd, 0, SEEK_END));
+#endif
+            this->durable = this->appended;
+            this->path = path;
+        }
+
+        WriteAheadLog(const WriteAheadLog &) = delete;
+        WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+        ~WriteAheadLog() {
+            try {
+                commit(this->appended);
+            }
+            catch (const std::exception &) {}
+
+#ifdef _WIN32
+            CloseHandle(this->file);
+#else
+            ::close(this->fd);
+#endif
+        }
+
+        // Calls fn(payload, size) for every intact record from the start, cuts the log after the last one and
+        // returns how many there were. Must run before the first append.
+        template<typename FN>
+        std::size_t replay(FN fn) {
+            std::ifstream in(this->path, std::ios::binary);
+            std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            std::size_t pos = 0, count = 0;
+
+            while (pos + RECORD_HEADER <= data.size()) {
+                std::uint32_t size, sum;
+                std::memcpy(&size, &data[pos], sizeof(size));
+                std::memcpy(&sum, &data[pos + sizeof(size)], sizeof(sum));
+
+                if ((size > data.size() - pos - RECORD_HEADER) || (checksum(&data[pos + RECORD_HEADER], size) != sum)) break;
+
+                fn(static_cast<const void*>(&data[pos + RECORD_HEADER]), static_cast<std::size_t>(size));
+                pos += RECORD_HEADER + size;
+                count++;
+            }
+
+            truncate(pos);
+            return count;
+        }
+
+        // copies the record into the pending batch, returns the log position a commit has to reach for it
+        std::uint64_t append(const void *payload, std::uint32_t size) {
+            std::uint32_t sum = checksum(payload, size);
+
+            std::lock_guard<std::mutex> guard(this->mutex);
+            const char *bytes = static_cast<const char*>(payload);
+
+            this->pending.insert(this->pending.end(), reinterpret_cast<const char*>(&size),
+                reinterpret_cast<const char*>(&size) + sizeof(size));
+            this->pending.insert(this->pending.end(), reinterpret_cast<const char*>(&sum),
+                reinterpret_cast<const char*>(&sum) + sizeof(sum));
+            this->pending.insert(this->pending.end(), bytes, bytes + size);
+
+            this->appended += RECORD_HEADER + size;
+            return this->appended;
+        }
+
+        // returns once the log is on disk up to position
+        void commit(std::uint64_t position) {
+            std::unique_lock<std::mutex> guard(this->mutex);
+
+            while (this->durable < position) {
+                if (this->broken) throw std::runtime_error("write-ahead log failed, nothing after it is durable");
+
+                if (this->flushing) {
+                    this->flushed.wait(guard);
+                    continue;
+                }
+
+                // this thread writes the batch, the others wait for it or queue up the next one
+                this->flushing = true;
+                this->writing.swap(this->pending);
+                std::uint64_t end = this->appended;
+                guard.unlock();
+
+                bool ok = write_out(this->writing);
+                this->writing.clear();
+
+                guard.lock();
+                this->flushing = false;
+                if (ok) this->durable = end;
+                else this->broken = true;
+
+                this->flushed.notify_all();
+            }
+        }
+
+        std::uint64_t size() {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            return this->appended;
+        }
+
+        // how far the log is on disk, every record that ends there or before is durable
+        std::uint64_t synced() {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            return this->durable;
+        }
+
+    private:
+        // length and checksum
+        static const std::size_t RECORD_HEADER = 2 * sizeof(std::uint32_t);
+
+        // FNV-1a
+        static std::uint32_t checksum(const void *ptr, std::size_t size) {
+            const unsigned char *bytes = static_cast<const unsigned char*>(ptr);
+            std::uint32_t hash = 2166136261u;
+            for (std::size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 16777619u;
+
+            return hash;
+        }
+
+#ifdef _WIN32
+        bool write_out(const std::vector<char> &batch) {
+            std::size_t done = 0;
+
+            while (done < batch.size()) {
+                DWORD written = 0;
+                if (!WriteFile(this->file, batch.data() + done, static_cast<DWORD>(batch.size() - done), &written,
+                    nullptr)) return false;
+
+                done += written;
+            }
+
+            return FlushFileBuffers(this->file) != 0;
+        }
+
+        void truncate(std::size_t size) {
+            LARGE_INTEGER pos;
+            pos.QuadPart = static_cast<LONGLONG>(size);
+            SetFilePointerEx(this->file, pos, nullptr, FILE_BEGIN);
+            SetEndOfFile(this->file);
+
+            this->appended = this->durable = size;
+        }
+
+        HANDLE file;
+#else
+        bool write_out(const std::vector<char> &batch) {
+            std::size_t done = 0;
+
+            while (done < batch.size()) {
+                ssize_t written = ::write(this->fd, batch.data() + done, batch.size() - done);
+                if (written < 0) return false;
+
+                done += static_cast<std::size_t>(written);
+            }
+
+            // the data is what has to survive, not the file's times
+#ifdef __linux__
+            return fdatasync(this->fd) == 0;
+#else
+            return fsync(this->fd) == 0;
+#endif
+        }
+
+        void truncate(std::size_t size) {
+            if (ftruncate(this->fd, static_cast<off_t>(size)) != 0) throw std::runtime_error("can't cut " + this->path);
+            lseek(this->fd, static_cast<off_t>(size), SEEK_SET);
+
+            this->appended = this->durable = size;
+        }
+
+        int fd;
+#endif
+
+        std::string path;
+
+        std::mutex mutex;
+        std::condition_variable flushed;
+        // appended and not yet handed to a writer, and the batch being written, reused in turn
+        std::vector<char> pending;
+        std::vector<char> writing;
+
+        std::uint64_t appended;
+        std::uint64_t durable;
+        bool flushing;
+        bool broken;
+    };
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <shared_mutex>
+
+namespace AVLtree {
+    // Blind writes collected for one tree and applied together: apply() sorts them by key, so consecutive
+    // ones descend the same path, and runs them all under one acquisition of the tree's exclusive lock.
+    // Writes to the same key keep the order they were made in. Nothing is read, so unlike a Transaction
+    // there is nothing to validate and apply() always succeeds. The tree must outlive the batch.
+    template<typename TREE>
+    class WriteBatch {
+    public:
+        using key_type = typename TREE::key_type;
+        using data_type = typename TREE::data_type;
+        using value_type = typename TREE::value_type;
+        using size_type = std::size_t;
+
+        explicit WriteBatch(TREE &tree) : tree(&tree) {}
+
+        // adds key only if it isn't there when the batch is applied
+        void insert(const value_type &value) {
+            this->writes.push_back(Write{ value.first, value.second, INSERT, this->writes.size() });
+        }
+
+        void insert_or_assign(const key_type &key, const data_type &obj) {
+            this->writes.push_back(Write{ key, obj, ASSIGN, this->writes.size() });
+        }
+
+        void erase(const key_type &key) {
+            this->writes.push_back(Write{ key, data_type(), ERASE, this->writes.size() });
+        }
+
+        // leaves the batch empty for reuse
+        void apply() {
+            run([](size_type, bool) {});
+        }
+
+        // The same, and results[i] tells whether the i-th write added to the batch linked a new node.
+        void apply(std::vector<bool> &results) {
+            results.assign(this->writes.size(), false);
+            run([&](size_type index, bool linked) { results[index] = linked; });
+        }
+
+        // drops the writes not applied yet
+        void clear() {
+            this->writes.clear();
+        }
+
+        size_type size() const {
+            return this->writes.size();
+        }
+
+        bool empty() const {
+            return this->writes.empty();
+        }
+
+    private:
+        enum ops : unsigned char { INSERT, ASSIGN, ERASE };
+
+        struct Write {
+            key_type key;
+            data_type value;
+            ops op;
+            // where it was added, the sort moves it
+            size_type index;
+        };
+
+        template<typename REPORT>
+        void run(REPORT report) {
+            if (this->writes.empty()) return;
+
+            std::stable_sort(this->writes.begin(), this->writes.end(), [](const Write &a, const Write &b) {
+                return a.key < b.key;
+            });
+
+            {
+                std::unique_lock<std::shared_mutex> guard(this->tree->mutex);
+
+                for (Write &tmp : this->writes) {
+                    if (tmp.op == INSERT) report(tmp.index, this->tree->add(value_type(tmp.key, tmp.value)));
+                    else if (tmp.op == ASSIGN) report(tmp.index, this->tree->store(tmp.key, tmp.value));
+                    else this->tree->drop(tmp.key);
+                }
+            }
+
+            this->writes.clear();
+        }
+
+        TREE *tree;
+        std::vector<Write> writes;
+    };
+}
@@ -2,11 +2,748 @@
 #include <map>
 #include <ctime>
 #include <vector>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <limits>
 #include "AVLtree.hpp"
+#include "AVLtree_optimistic.hpp"
+#include "AVLtree_fine.hpp"
+#include "AVLtree_persistent.hpp"
+#include "AVLtree_sharded.hpp"
+#include "AVLtree_bucket.hpp"
+#include "AVLtree_durable.hpp"
+#include "AVLtree_async.hpp"
 
 using namespace std;
 using namespace AVLtree;
 
+template<template<typename> class POINTER>
+void pointer_benchmark(const char *name, const vector<int> &keys) {
+	AVL<int, int, POINTER> tree;
+
+	auto startInsert = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+	auto endInsert = chrono::high_resolution_clock::now();
+
+	long long sum = 0;
+	auto startFind = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) sum += tree.at(keys[j]);
+	auto endFind = chrono::high_resolution_clock::now();
+
+	auto timeInsert = chrono::duration_cast<chrono::milliseconds>(endInsert - startInsert);
+	auto timeFind = chrono::duration_cast<chrono::milliseconds>(endFind - startFind);
+
+	cout << name << ":" << endl;
+	cout << "INSERT TIME = " << (double)timeInsert.count() / 1000.0 << endl;
+	cout << "FIND TIME = " << (double)timeFind.count() / 1000.0 << " (" << sum << ")" << endl;
+	cout << "BYTES PER ENTRY = " << (double)tree.memory_usage() / tree.size() << endl << endl;
+}
+
+// one key per node against buckets of keys, the height counts levels of nodes either way
+template<typename TREE>
+void bucket_benchmark(const char *name, const vector<int> &keys) {
+	TREE tree;
+
+	auto startInsert = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+	auto endInsert = chrono::high_resolution_clock::now();
+
+	long long sum = 0;
+	auto startFind = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) sum += tree.at(keys[j]);
+	auto endFind = chrono::high_resolution_clock::now();
+
+	auto timeInsert = chrono::duration_cast<chrono::milliseconds>(endInsert - startInsert);
+	auto timeFind = chrono::duration_cast<chrono::milliseconds>(endFind - startFind);
+
+	cout << name << ":" << endl;
+	cout << "INSERT TIME = " << (double)timeInsert.count() / 1000.0 << endl;
+	cout << "FIND TIME = " << (double)timeFind.count() / 1000.0 << " (" << sum << ")" << endl;
+	cout << "HEIGHT = " << tree.height() << endl << endl;
+}
+
+void print_memory(HeapAllocator &) {}
+
+void print_memory(SlabAllocator &allocator) {
+	cout << "BYTES RESERVED = " << allocator.bytes_reserved() << endl;
+	cout << "BYTES IN USE = " << allocator.bytes_in_use() << endl;
+}
+
+template<typename ALLOC>
+void allocator_benchmark(const char *name, const vector<int> &keys) {
+	auto startInsert = chrono::high_resolution_clock::now();
+	auto tree = new AVL<int, int, IntrusivePointer, ALLOC>();
+	for (size_t j = 0; j < keys.size(); ++j) tree->insert(pair<int, int>(keys[j], j));
+	auto endInsert = chrono::high_resolution_clock::now();
+
+	cout << name << ":" << endl;
+	print_memory(tree->get_allocator());
+	cout << "BYTES PER ENTRY = " << (double)tree->memory_usage() / tree->size() << endl;
+
+	auto startDestroy = chrono::high_resolution_clock::now();
+	delete tree;
+	auto endDestroy = chrono::high_resolution_clock::now();
+
+	auto timeInsert = chrono::duration_cast<chrono::milliseconds>(endInsert - startInsert);
+	auto timeDestroy = chrono::duration_cast<chrono::milliseconds>(endDestroy - startDestroy);
+
+	cout << "INSERT TIME = " << (double)timeInsert.count() / 1000.0 << endl;
+	cout << "DESTROY TIME = " << (double)timeDestroy.count() / 1000.0 << endl << endl;
+}
+
+// the same keys spread round-robin over that many trees of one allocator type, each with its own arena
+template<typename ALLOC>
+void alternating_benchmark(const char *name, const vector<int> &keys, size_t trees) {
+	vector<AVL<int, int, IntrusivePointer, ALLOC>*> all(trees);
+	for (size_t t = 0; t < trees; ++t) all[t] = new AVL<int, int, IntrusivePointer, ALLOC>();
+
+	auto startInsert = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) all[j % trees]->insert(pair<int, int>(keys[j], j));
+	auto endInsert = chrono::high_resolution_clock::now();
+
+	auto startErase = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) all[j % trees]->erase(keys[j]);
+	auto endErase = chrono::high_resolution_clock::now();
+
+	for (size_t t = 0; t < trees; ++t) delete all[t];
+
+	auto timeInsert = chrono::duration_cast<chrono::milliseconds>(endInsert - startInsert);
+	auto timeErase = chrono::duration_cast<chrono::milliseconds>(endErase - startErase);
+
+	cout << name << " (" << trees << " TREES):" << endl;
+	cout << "INSERT TIME = " << (double)timeInsert.count() / 1000.0 << endl;
+	cout << "ERASE TIME = " << (double)timeErase.count() / 1000.0 << endl << endl;
+}
+
+struct Payload {
+	static long long copies;
+
+	Payload() {}
+	Payload(int n) : data(n, n) {}
+	Payload(const Payload &tmp) : data(tmp.data) { copies++; }
+	Payload(Payload &&tmp) : data(std::move(tmp.data)) {}
+
+	Payload &operator=(const Payload &tmp) {
+		data = tmp.data;
+		copies++;
+		return *this;
+	}
+
+	Payload &operator=(Payload &&tmp) {
+		data = std::move(tmp.data);
+		return *this;
+	}
+
+	vector<int> data;
+};
+
+long long Payload::copies = 0;
+
+template<typename INSERT>
+void emplace_benchmark(const char *name, const vector<string> &keys, INSERT insert) {
+	AVL<string, Payload> tree;
+	Payload::copies = 0;
+
+	auto startInsert = chrono::high_resolution_clock::now();
+	for (int round = 0; round < 2; ++round) {
+		for (size_t j = 0; j < keys.size(); ++j) insert(tree, keys[j]);
+	}
+	auto endInsert = chrono::high_resolution_clock::now();
+
+	auto timeInsert = chrono::duration_cast<chrono::milliseconds>(endInsert - startInsert);
+
+	cout << name << ":" << endl;
+	cout << "INSERT TIME = " << (double)timeInsert.count() / 1000.0 << endl;
+	cout << "PAYLOAD COPIES = " << Payload::copies << endl << endl;
+}
+
+// every thread looks up all keys, the tree is shared and nobody writes
+template<typename TREE>
+void read_benchmark(const char *name, const vector<int> &keys, int threads_count) {
+	TREE tree;
+	for (size_t j = 0; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+
+	vector<thread> threads;
+	atomic<long long> total(0);
+	auto startFind = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&] {
+			long long sum = 0;
+			for (size_t j = 0; j < keys.size(); ++j) sum += tree.at(keys[j]);
+			total += sum;
+			}));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	auto endFind = chrono::high_resolution_clock::now();
+
+	auto timeFind = chrono::duration_cast<chrono::milliseconds>(endFind - startFind);
+
+	cout << name << " (" << threads_count << " THREADS):" << endl;
+	cout << "FIND TIME = " << (double)timeFind.count() / 1000.0 << " (" << total << ")" << endl;
+	cout << "LOOKUPS PER SECOND = " << (long long)(threads_count * keys.size() / ((double)timeFind.count() / 1000.0 + 1e-9)) << endl << endl;
+}
+
+// the keys are split between the threads, each inserts its share and then erases half of it
+template<typename TREE>
+void write_benchmark(const char *name, const vector<int> &keys, int threads_count, TREE &tree) {
+	vector<thread> threads;
+	size_t part = keys.size() / threads_count;
+
+	auto startWrite = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&](int th) {
+			for (size_t j = th * part; j < (th + 1) * part; ++j) tree.insert(pair<int, int>(keys[j], j));
+			for (size_t j = th * part; j < (th + 1) * part; j += 2) tree.erase(keys[j]);
+			}, i));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	auto endWrite = chrono::high_resolution_clock::now();
+
+	auto timeWrite = chrono::duration_cast<chrono::milliseconds>(endWrite - startWrite);
+
+	cout << name << " (" << threads_count << " THREADS):" << endl;
+	cout << "WRITE TIME = " << (double)timeWrite.count() / 1000.0 << " (" << tree.size() << ")" << endl << endl;
+}
+
+template<typename TREE>
+void write_benchmark(const char *name, const vector<int> &keys, int threads_count) {
+	TREE tree;
+	write_benchmark(name, keys, threads_count, tree);
+}
+
+// one thread scans the whole tree over and over while another keeps inserting
+template<typename TREE, typename SCAN>
+void scan_benchmark(const char *name, const vector<int> &keys, SCAN scan) {
+	TREE tree;
+	size_t half = keys.size() / 2;
+	for (size_t j = 0; j < half; ++j) tree.insert(pair<int, int>(keys[j], j));
+
+	atomic<bool> done(false);
+	long long scans = 0, scanned = 0;
+
+	auto start = chrono::high_resolution_clock::now();
+	thread reader([&] {
+		while (!done) {
+			scanned += scan(tree);
+			scans++;
+		}
+		});
+
+	for (size_t j = half; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+	auto endWrite = chrono::high_resolution_clock::now();
+
+	done = true;
+	reader.join();
+
+	auto timeWrite = chrono::duration_cast<chrono::milliseconds>(endWrite - start);
+
+	cout << name << ":" << endl;
+	cout << "INGEST TIME = " << (double)timeWrite.count() / 1000.0 << endl;
+	cout << "SCANS = " << scans << " (" << scanned << " NODES)" << endl << endl;
+}
+
+// the same pairs loaded key by key and in one bulk_load
+void load_benchmark(const char *name, const vector<pair<int, int>> &values) {
+	AVL<int, int> by_insert, by_load;
+
+	auto startInsert = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < values.size(); ++j) by_insert.insert(values[j]);
+	auto endInsert = chrono::high_resolution_clock::now();
+
+	auto startLoad = chrono::high_resolution_clock::now();
+	by_load.bulk_load(values.begin(), values.end());
+	auto endLoad = chrono::high_resolution_clock::now();
+
+	auto timeInsert = chrono::duration_cast<chrono::milliseconds>(endInsert - startInsert);
+	auto timeLoad = chrono::duration_cast<chrono::milliseconds>(endLoad - startLoad);
+
+	cout << name << ":" << endl;
+	cout << "INSERT TIME = " << (double)timeInsert.count() / 1000.0 << " (HEIGHT " << by_insert.height() << ")" << endl;
+	cout << "BULK LOAD TIME = " << (double)timeLoad.count() / 1000.0 << " (HEIGHT " << by_load.height() << ")" << endl << endl;
+}
+
+// random lookups of present keys, the live tree against its frozen copy, in nanoseconds per lookup
+void freeze_benchmark(const char *name, int n) {
+	mt19937 gen(n);
+	vector<pair<int, int>> values(n);
+	for (int j = 0; j < n; ++j) values[j] = make_pair(2 * j, j);
+
+	AVL<int, int> tree;
+	tree.bulk_load(values.begin(), values.end());
+	values.clear();
+	values.shrink_to_fit();
+
+	auto startFreeze = chrono::high_resolution_clock::now();
+	auto frozen = tree.freeze();
+	auto endFreeze = chrono::high_resolution_clock::now();
+
+	vector<int> probes(1000000);
+	for (size_t j = 0; j < probes.size(); ++j) probes[j] = 2 * (int)(gen() % n);
+
+	auto measure = [&](auto lookup) {
+		long long sum = 0;
+		auto start = chrono::high_resolution_clock::now();
+		for (size_t j = 0; j < probes.size(); ++j) sum += lookup(probes[j]);
+		auto end = chrono::high_resolution_clock::now();
+
+		auto time = chrono::duration_cast<chrono::nanoseconds>(end - start);
+		return make_pair((double)time.count() / probes.size(), sum);
+	};
+
+	auto treeAt = measure([&](int key) { return tree.at(key); });
+	auto frozenAt = measure([&](int key) { return frozen.at(key); });
+	auto treeBound = measure([&](int key) { return tree.lower_bound(key - 1).get_value(); });
+	auto frozenBound = measure([&](int key) { return frozen.lower_bound(key - 1).get_value(); });
+
+	auto timeFreeze = chrono::duration_cast<chrono::milliseconds>(endFreeze - startFreeze);
+
+	cout << name << " (" << n << " KEYS):" << endl;
+	cout << "FREEZE TIME = " << (double)timeFreeze.count() / 1000.0 << endl;
+	cout << "TREE AT = " << treeAt.first << " NS (" << treeAt.second << ")" << endl;
+	cout << "FROZEN AT = " << frozenAt.first << " NS (" << frozenAt.second << ")" << endl;
+	cout << "TREE LOWER_BOUND = " << treeBound.first << " NS (" << treeBound.second << ")" << endl;
+	cout << "FROZEN LOWER_BOUND = " << frozenBound.first << " NS (" << frozenBound.second << ")" << endl << endl;
+}
+
+// startup from scratch: replaying every insert against mapping a file saved earlier, then the same lookups
+void snapshot_benchmark(const char *name, const vector<int> &keys) {
+	const char *path = "avl_snapshot.bin";
+	{
+		AVL<int, int> tree;
+		for (size_t j = 0; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+		tree.save(path);
+	}
+
+	auto startReplay = chrono::high_resolution_clock::now();
+	AVL<int, int> tree;
+	for (size_t j = 0; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+	auto endReplay = chrono::high_resolution_clock::now();
+
+	auto startOpen = chrono::high_resolution_clock::now();
+	auto mapped = AVL<int, int>::open_mmap(path);
+	auto endOpen = chrono::high_resolution_clock::now();
+
+	long long treeSum = 0, mappedSum = 0;
+	auto startTree = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) treeSum += tree.at(keys[j]);
+	auto endTree = chrono::high_resolution_clock::now();
+
+	auto startMapped = chrono::high_resolution_clock::now();
+	for (size_t j = 0; j < keys.size(); ++j) mappedSum += mapped.at(keys[j]);
+	auto endMapped = chrono::high_resolution_clock::now();
+
+	auto timeReplay = chrono::duration_cast<chrono::microseconds>(endReplay - startReplay);
+	auto timeOpen = chrono::duration_cast<chrono::microseconds>(endOpen - startOpen);
+	auto timeTree = chrono::duration_cast<chrono::milliseconds>(endTree - startTree);
+	auto timeMapped = chrono::duration_cast<chrono::milliseconds>(endMapped - startMapped);
+
+	cout << name << ":" << endl;
+	cout << "REPLAY TIME = " << (double)timeReplay.count() / 1000000.0 << endl;
+	cout << "OPEN_MMAP TIME = " << (double)timeOpen.count() / 1000000.0 << " (" << mapped.size() << ")" << endl;
+	cout << "TREE FIND TIME = " << (double)timeTree.count() / 1000.0 << " (" << treeSum << ")" << endl;
+	cout << "MAPPED FIND TIME = " << (double)timeMapped.count() / 1000.0 << " (" << mappedSum << ")" << endl << endl;
+
+	remove(path);
+}
+
+// every insert waits for its commit; reports the latency a writer sees, then reopens the log
+void commit_benchmark(const char *name, const vector<int> &keys, int threads_count) {
+	const char *path = "avl_commit.wal";
+	vector<thread> threads;
+	vector<vector<long long>> latencies(threads_count);
+	size_t part = keys.size() / threads_count;
+	remove(path);
+
+	{
+		AVLtreeDurable::DurableAVL<int, int> tree(path);
+
+		for (int i = 0; i < threads_count; ++i) {
+			threads.push_back(thread([&](int th) {
+				for (size_t j = th * part; j < (th + 1) * part; ++j) {
+					auto start = chrono::high_resolution_clock::now();
+					tree.insert(pair<int, int>(keys[j], j));
+					auto end = chrono::high_resolution_clock::now();
+					latencies[th].push_back(chrono::duration_cast<chrono::microseconds>(end - start).count());
+				}
+				}, i));
+		}
+
+		for (int i = 0; i < threads_count; ++i) threads[i].join();
+	}
+
+	vector<long long> all;
+	for (auto &tmp : latencies) all.insert(all.end(), tmp.begin(), tmp.end());
+	sort(all.begin(), all.end());
+
+	auto startReplay = chrono::high_resolution_clock::now();
+	AVLtreeDurable::DurableAVL<int, int> tree(path);
+	auto endReplay = chrono::high_resolution_clock::now();
+
+	auto timeReplay = chrono::duration_cast<chrono::microseconds>(endReplay - startReplay);
+
+	cout << name << " (" << threads_count << " THREADS):" << endl;
+	cout << "COMMIT LATENCY P50 = " << all[all.size() / 2] << " us, P99 = " << all[all.size() * 99 / 100] << " us" << endl;
+	cout << "REPLAY TIME = " << (double)timeReplay.count() / 1000000.0 << " (" << tree.replayed_records() << " RECORDS, "
+		<< tree.size() << ")" << endl << endl;
+
+	remove(path);
+}
+
+// every thread moves money between random accounts, as transactions and under one outside mutex
+void transfer_benchmark(const char *name, int accounts, int threads_count) {
+	const int transfers = 100000;
+	AVL<int, long long> txn_tree, mutex_tree;
+	mutex global;
+	atomic<long long> aborted(0);
+	vector<thread> threads;
+
+	for (int j = 0; j < accounts; ++j) {
+		txn_tree.insert(pair<int, long long>(j, 1000));
+		mutex_tree.insert(pair<int, long long>(j, 1000));
+	}
+
+	auto startTxn = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&](int th) {
+			mt19937 gen(th);
+
+			for (int j = 0; j < transfers / threads_count; ++j) {
+				int from = gen() % accounts, to = (from + 1 + gen() % (accounts - 1)) % accounts;
+				long long amount = gen() % 100;
+
+				while (true) {
+					auto txn = txn_tree.begin_txn();
+					txn.insert_or_assign(from, txn.at(from) - amount);
+					txn.insert_or_assign(to, txn.at(to) + amount);
+
+					if (txn.commit()) break;
+					aborted++;
+				}
+			}
+			}, i));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	auto endTxn = chrono::high_resolution_clock::now();
+	threads.clear();
+
+	auto startMutex = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&](int th) {
+			mt19937 gen(th);
+
+			for (int j = 0; j < transfers / threads_count; ++j) {
+				int from = gen() % accounts, to = (from + 1 + gen() % (accounts - 1)) % accounts;
+				long long amount = gen() % 100;
+
+				lock_guard<mutex> guard(global);
+				mutex_tree.insert_or_assign(from, mutex_tree.at(from) - amount);
+				mutex_tree.insert_or_assign(to, mutex_tree.at(to) + amount);
+			}
+			}, i));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	auto endMutex = chrono::high_resolution_clock::now();
+
+	long long total = 0;
+	for (auto it = txn_tree.begin(); it != txn_tree.end(); ++it) total += it.get_value();
+
+	auto timeTxn = chrono::duration_cast<chrono::milliseconds>(endTxn - startTxn);
+	auto timeMutex = chrono::duration_cast<chrono::milliseconds>(endMutex - startMutex);
+	long long done = (long long)(transfers / threads_count) * threads_count;
+
+	cout << name << " (" << accounts << " ACCOUNTS, " << threads_count << " THREADS):" << endl;
+	cout << "TRANSACTION TIME = " << (double)timeTxn.count() / 1000.0 << " (" << total << ")" << endl;
+	cout << "TRANSFERS PER SECOND = " << (long long)(done / ((double)timeTxn.count() / 1000.0 + 1e-9)) << endl;
+	cout << "ABORT RATE = " << (double)aborted / (double)(done + aborted) << endl;
+	cout << "GLOBAL MUTEX TIME = " << (double)timeMutex.count() / 1000.0 << endl << endl;
+}
+
+// what a producer waits for per insert: the tree lock, or a push onto the write-behind queue
+void async_benchmark(const char *name, const vector<int> &keys, int threads_count) {
+	AVL<int, int> tree;
+	AVLtreeAsync::AsyncAVL<int, int> async;
+	vector<thread> threads;
+	size_t part = keys.size() / threads_count;
+
+	auto startLocked = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&](int th) {
+			for (size_t j = th * part; j < (th + 1) * part; ++j) tree.insert(pair<int, int>(keys[j], j));
+			}, i));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	auto endLocked = chrono::high_resolution_clock::now();
+	threads.clear();
+
+	auto startSubmit = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&](int th) {
+			for (size_t j = th * part; j < (th + 1) * part; ++j) async.insert(pair<int, int>(keys[j], j));
+			}, i));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	auto endSubmit = chrono::high_resolution_clock::now();
+	async.flush();
+	auto endFlush = chrono::high_resolution_clock::now();
+
+	auto timeLocked = chrono::duration_cast<chrono::nanoseconds>(endLocked - startLocked);
+	auto timeSubmit = chrono::duration_cast<chrono::nanoseconds>(endSubmit - startSubmit);
+	auto timeFlush = chrono::duration_cast<chrono::microseconds>(endFlush - endSubmit);
+
+	// per thread, the threads run side by side
+	double perThread = (double)part;
+
+	cout << name << " (" << threads_count << " THREADS):" << endl;
+	cout << "LOCKED INSERT LATENCY = " << (double)timeLocked.count() / perThread << " ns (" << tree.size() << ")" << endl;
+	cout << "ASYNC SUBMIT LATENCY = " << (double)timeSubmit.count() / perThread << " ns" << endl;
+	cout << "FLUSH TIME = " << (double)timeFlush.count() / 1000000.0 << " (" << async.size() << ")" << endl << endl;
+}
+
+// per write latency of threads_count writers, a maintenance thread rebalances a relaxed tree meanwhile
+void balancing_benchmark(const char *name, const vector<int> &keys, int threads_count, bool relaxed) {
+	AVL<int, int> tree;
+	vector<thread> threads;
+	vector<vector<long long>> latencies(threads_count);
+	atomic<bool> done(false);
+	size_t part = keys.size() / threads_count;
+
+	tree.set_relaxed(relaxed);
+	thread maintenance([&] {
+		while (!done.load()) {
+			if ((!relaxed) || (tree.rebalance_pending(16) == 0)) this_thread::yield();
+		}
+		});
+
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&](int th) {
+			for (size_t j = th * part; j < (th + 1) * part; ++j) {
+				auto start = chrono::high_resolution_clock::now();
+				if (j % 4 == 3) tree.erase(keys[j - 1]);
+				else tree.insert(pair<int, int>(keys[j], j));
+				auto end = chrono::high_resolution_clock::now();
+				latencies[th].push_back(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+			}
+			}, i));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	done = true;
+	maintenance.join();
+
+	vector<long long> all;
+	for (auto &tmp : latencies) all.insert(all.end(), tmp.begin(), tmp.end());
+	sort(all.begin(), all.end());
+
+	cout << name << " (" << threads_count << " THREADS):" << endl;
+	cout << "WRITE LATENCY P50 = " << all[all.size() / 2] << " ns, P99 = " << all[all.size() * 99 / 100] << " ns, P999 = "
+		<< all[all.size() * 999 / 1000] << " ns (" << tree.size() << ")" << endl << endl;
+}
+
+// A sliding window of n keys: every write adds the newest key and expires the oldest one, while a reader
+// looks up keys inside the window; lazy erase buries the old keys and compacts them away in bulk.
+void expiry_benchmark(const char *name, int n, int threads_count, bool lazy) {
+	AVL<int, int> tree;
+	vector<thread> threads;
+	vector<vector<long long>> latencies(threads_count);
+	atomic<bool> done(false);
+	atomic<long long> lookups(0);
+	int part = n / threads_count;
+
+	for (int j = 0; j < n; ++j) tree.insert(pair<int, int>(j, j));
+	tree.set_lazy_erase(lazy);
+
+	thread reader([&] {
+		mt19937 gen(1);
+		long long count = 0;
+		while (!done.load()) {
+			try {
+				tree.at(n + (int)(gen() % n));
+			}
+			catch (const out_of_range &) {}
+			count++;
+		}
+		lookups = count;
+		});
+
+	auto startWrites = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&](int th) {
+			for (int j = th * part; j < (th + 1) * part; ++j) {
+				tree.insert(pair<int, int>(n + j, j));
+				auto start = chrono::high_resolution_clock::now();
+				tree.erase(j);
+				auto end = chrono::high_resolution_clock::now();
+				latencies[th].push_back(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+			}
+			}, i));
+	}
+
+	for (int i = 0; i < threads_count; ++i) threads[i].join();
+	auto endWrites = chrono::high_resolution_clock::now();
+	done = true;
+	reader.join();
+
+	vector<long long> all;
+	for (auto &tmp : latencies) all.insert(all.end(), tmp.begin(), tmp.end());
+	sort(all.begin(), all.end());
+
+	auto time = chrono::duration_cast<chrono::microseconds>(endWrites - startWrites);
+
+	cout << name << " (" << threads_count << " THREADS):" << endl;
+	cout << "TIME = " << (double)time.count() / 1000000.0 << ", LOOKUPS = " << lookups << endl;
+	cout << "ERASE LATENCY P50 = " << all[all.size() / 2] << " ns, P99 = " << all[all.size() * 99 / 100] << " ns, P999 = "
+		<< all[all.size() * 999 / 1000] << " ns (" << tree.size() << ")" << endl << endl;
+}
+
+// drops the oldest tenth of the keys, one erase per key against one erase_range
+void range_benchmark(const char *name, int n) {
+	AVL<int, int> by_erase, by_range;
+	for (int j = 0; j < n; ++j) {
+		by_erase.insert(pair<int, int>(j, j));
+		by_range.insert(pair<int, int>(j, j));
+	}
+
+	auto startErase = chrono::high_resolution_clock::now();
+	for (int j = 0; j < n / 10; ++j) by_erase.erase(j);
+	auto endErase = chrono::high_resolution_clock::now();
+
+	auto startRange = chrono::high_resolution_clock::now();
+	by_range.erase_range(0, n / 10);
+	auto endRange = chrono::high_resolution_clock::now();
+
+	auto timeErase = chrono::duration_cast<chrono::microseconds>(endErase - startErase);
+	auto timeRange = chrono::duration_cast<chrono::microseconds>(endRange - startRange);
+
+	cout << name << ":" << endl;
+	cout << "ERASE TIME = " << (double)timeErase.count() / 1000000.0 << endl;
+	cout << "ERASE_RANGE TIME = " << (double)timeRange.count() / 1000000.0 << " (" << by_range.size() << ")" << endl << endl;
+}
+
+// merges two trees, by walking one and inserting into the other against one union_with
+void union_benchmark(const char *name, const vector<int> &keys) {
+	AVL<int, int> by_insert, by_union, other;
+	size_t half = keys.size() / 2;
+
+	for (size_t j = 0; j < keys.size(); ++j) {
+		if (j < half) {
+			by_insert.insert(pair<int, int>(keys[j], j));
+			by_union.insert(pair<int, int>(keys[j], j));
+		}
+		else other.insert(pair<int, int>(keys[j], j));
+	}
+
+	auto startInsert = chrono::high_resolution_clock::now();
+	for (auto it = other.begin(); it != other.end(); ++it) by_insert.insert(pair<int, int>(it.get_key(), it.get_value()));
+	auto endInsert = chrono::high_resolution_clock::now();
+
+	auto startUnion = chrono::high_resolution_clock::now();
+	by_union.union_with(other);
+	auto endUnion = chrono::high_resolution_clock::now();
+
+	auto timeInsert = chrono::duration_cast<chrono::milliseconds>(endInsert - startInsert);
+	auto timeUnion = chrono::duration_cast<chrono::milliseconds>(endUnion - startUnion);
+
+	cout << name << " (" << ThreadPool::instance().size() << " THREADS):" << endl;
+	cout << "INSERT TIME = " << (double)timeInsert.count() / 1000.0 << " (" << by_insert.size() << ")" << endl;
+	cout << "UNION TIME = " << (double)timeUnion.count() / 1000.0 << " (" << by_union.size() << ")" << endl << endl;
+}
+
+// finds a few percentiles, by walking an iterator from begin() against select()
+void percentile_benchmark(const char *name, const vector<int> &keys) {
+	AVL<int, int> tree;
+	for (size_t j = 0; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+
+	const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	long long sum_walk = 0, sum_select = 0;
+
+	auto startWalk = chrono::high_resolution_clock::now();
+	for (double p : percentiles) {
+		size_t index = (size_t)(p * (tree.size() - 1));
+		auto it = tree.begin();
+		for (size_t j = 0; j < index; ++j) ++it;
+		sum_walk += it.get_key();
+	}
+	auto endWalk = chrono::high_resolution_clock::now();
+
+	auto startSelect = chrono::high_resolution_clock::now();
+	for (double p : percentiles) sum_select += tree.select((size_t)(p * (tree.size() - 1))).first;
+	auto endSelect = chrono::high_resolution_clock::now();
+
+	auto timeWalk = chrono::duration_cast<chrono::microseconds>(endWalk - startWalk);
+	auto timeSelect = chrono::duration_cast<chrono::microseconds>(endSelect - startSelect);
+
+	cout << name << ":" << endl;
+	cout << "ITERATOR WALK TIME = " << (double)timeWalk.count() / 1000000.0 << " (" << sum_walk << ")" << endl;
+	cout << "SELECT TIME = " << (double)timeSelect.count() / 1000000.0 << " (" << sum_select << ")" << endl << endl;
+}
+
+// sums a thousand ranges of about a thousand keys each, stepping iterators from lower_bound against one
+// for_each_in_range per range
+void range_scan_benchmark(const char *name, int n) {
+	AVL<int, int> tree;
+	for (int j = 0; j < n; ++j) tree.insert(pair<int, int>(j, j));
+
+	long long sum_iterator = 0, sum_callback = 0;
+
+	auto startIterator = chrono::high_resolution_clock::now();
+	for (int j = 0; j < 1000; ++j) {
+		int lo = rand() % n;
+		auto end = tree.lower_bound(lo + 1000);
+		for (auto it = tree.lower_bound(lo); it != end; ++it) sum_iterator += it.get_value();
+	}
+	auto endIterator = chrono::high_resolution_clock::now();
+
+	auto startCallback = chrono::high_resolution_clock::now();
+	for (int j = 0; j < 1000; ++j) {
+		int lo = rand() % n;
+		tree.for_each_in_range(lo, lo + 1000, [&](const pair<const int, int> &value) { sum_callback += value.second; });
+	}
+	auto endCallback = chrono::high_resolution_clock::now();
+
+	auto timeIterator = chrono::duration_cast<chrono::milliseconds>(endIterator - startIterator);
+	auto timeCallback = chrono::duration_cast<chrono::milliseconds>(endCallback - startCallback);
+
+	cout << name << ":" << endl;
+	cout << "ITERATOR SCAN TIME = " << (double)timeIterator.count() / 1000.0 << endl;
+	cout << "FOR_EACH_IN_RANGE TIME = " << (double)timeCallback.count() / 1000.0 << endl << endl;
+}
+
+// every thread walks the whole tree with its own iterator
+void iterator_scan_benchmark(const char *name, const vector<int> &keys, int threads_count) {
+	AVL<int, int> tree;
+	for (size_t j = 0; j < keys.size(); ++j) tree.insert(pair<int, int>(keys[j], j));
+
+	vector<thread> threads;
+	atomic<long long> scanned(0);
+
+	auto start = chrono::high_resolution_clock::now();
+	for (int i = 0; i < threads_count; ++i) {
+		threads.push_back(thread([&] {
+			long long count = 0;
+			for (auto it = tree.begin(); it != tree.end(); ++it) count++;
+			scanned += count;
+			}));
+	}
+
+	for (auto &tmp : threads) tmp.join();
+	auto end = chrono::high_resolution_clock::now();
+
+	auto time = chrono::duration_cast<chrono::milliseconds>(end - start);
+
+	cout << name << " (" << threads_count << " THREADS):" << endl;
+	cout << "SCAN TIME = " << (double)time.count() / 1000.0 << " (" << scanned << " NODES)" << endl << endl;
+}
+
 int main() {
 	int n = 10000, threads_count = 8;
 	srand(time(0));
@@ -26,6 +763,138 @@ int main() {
 	while (--iter != tree.begin()) {
 		if (!(key_ >= iter.get_key())) cout << "SUCK COCK\n";
 	}
+
+	mt19937 gen(time(0));
+	vector<int> keys(1000000);
+	for (size_t j = 0; j < keys.size(); ++j) keys[j] = gen();
+
+	pointer_benchmark<SmartPointer>("CORE SMART POINTER", keys);
+	pointer_benchmark<IntrusivePointer>("INTRUSIVE POINTER", keys);
+	pointer_benchmark<EpochPointer>("EPOCH POINTER", keys);
+
+	allocator_benchmark<HeapAllocator>("HEAP ALLOCATOR", keys);
+	allocator_benchmark<SlabAllocator>("SLAB ALLOCATOR", keys);
+	alternating_benchmark<HeapAllocator>("HEAP ALLOCATOR", keys, 4);
+	alternating_benchmark<SlabAllocator>("SLAB ALLOCATOR", keys, 1);
+	alternating_benchmark<SlabAllocator>("SLAB ALLOCATOR", keys, 4);
+
+	bucket_benchmark<AVL<int, int>>("SINGLE KEY NODES", keys);
+	bucket_benchmark<AVLtreeBucket::AVL_bucket<int, int, 16>>("16 KEY BUCKETS", keys);
+	bucket_benchmark<AVLtreeBucket::AVL_bucket<int, int, 32>>("32 KEY BUCKETS", keys);
+
+	// every key is inserted twice, the second round only hits duplicates
+	vector<string> string_keys(200000);
+	for (size_t j = 0; j < string_keys.size(); ++j) string_keys[j] = "key_" + to_string(gen());
+
+	emplace_benchmark("INSERT CONST REFERENCE", string_keys, [](AVL<string, Payload> &tree, const string &key) {
+		pair<const string, Payload> value(key, Payload(64));
+		tree.insert(value);
+		});
+	emplace_benchmark("INSERT RVALUE", string_keys, [](AVL<string, Payload> &tree, const string &key) {
+		tree.insert(pair<const string, Payload>(key, Payload(64)));
+		});
+	emplace_benchmark("EMPLACE", string_keys, [](AVL<string, Payload> &tree, const string &key) {
+		tree.emplace(key, 64);
+		});
+	emplace_benchmark("TRY_EMPLACE", string_keys, [](AVL<string, Payload> &tree, const string &key) {
+		tree.try_emplace(key, 64);
+		});
+	emplace_benchmark("INSERT_OR_ASSIGN", string_keys, [](AVL<string, Payload> &tree, const string &key) {
+		tree.insert_or_assign(key, Payload(64));
+		});
+
+	vector<int> read_keys(keys.begin(), keys.begin() + 200000);
+	for (int threads_count : { 1, 2, 4, 8 }) {
+		read_benchmark<AVL<int, int>>("SHARED MUTEX READS", read_keys, threads_count);
+		read_benchmark<AVL<int, int, EpochPointer>>("SHARED MUTEX EPOCH READS", read_keys, threads_count);
+		read_benchmark<AVLtreeOptimistic::AVL_optimistic<int, int>>("OPTIMISTIC READS", read_keys, threads_count);
+	}
+
+	for (int threads_count : { 1, 2, 4, 8 }) {
+		write_benchmark<AVL<int, int>>("TREE LOCK WRITES", read_keys, threads_count);
+		write_benchmark<AVLtreeFine::AVL_fine<int, int>>("NODE LOCK WRITES", read_keys, threads_count);
+	}
+
+	// the keys are uniform over all ints, so even bounds give every shard the same share
+	vector<int> bounds;
+	for (long long i = 1; i < 16; ++i) bounds.push_back((int)(numeric_limits<int>::min() + i * (1LL << 32) / 16));
+
+	for (int threads_count : { 1, 2, 4, 8, 16, 32 }) {
+		AVLtreeSharded::ShardedAVL<int, int, 16> ranged(bounds);
+		AVL<int, int> combined;
+		Combiner<AVL<int, int>> combiner(combined);
+
+		write_benchmark<AVL<int, int>>("TREE LOCK WRITES", read_keys, threads_count);
+		write_benchmark("FLAT COMBINING WRITES", read_keys, threads_count, combiner);
+		write_benchmark<AVLtreeSharded::ShardedAVL<int, int, 16>>("HASH SHARDED WRITES", read_keys, threads_count);
+		write_benchmark("RANGE SHARDED WRITES", read_keys, threads_count, ranged);
+	}
+
+	// every durable write is synced before it returns, the threads share their syncs
+	vector<int> durable_keys(keys.begin(), keys.begin() + 50000);
+	for (int threads_count : { 1, 2, 4, 8, 16 }) {
+		remove("avl_write.wal");
+		remove("avl_deferred.wal");
+		AVLtreeDurable::DurableAVL<int, int> durable("avl_write.wal"), deferred("avl_deferred.wal", false);
+
+		write_benchmark<AVL<int, int>>("IN MEMORY WRITES", durable_keys, threads_count);
+		write_benchmark("WRITE-AHEAD LOG WRITES", durable_keys, threads_count, durable);
+		write_benchmark("DEFERRED SYNC WRITES", durable_keys, threads_count, deferred);
+		deferred.sync();
+		commit_benchmark("WRITE-AHEAD LOG COMMITS", durable_keys, threads_count);
+	}
+	remove("avl_write.wal");
+	remove("avl_deferred.wal");
+
+	for (int threads_count : { 1, 4, 16 }) {
+		balancing_benchmark("STRICT BALANCING", keys, threads_count, false);
+		balancing_benchmark("RELAXED BALANCING", keys, threads_count, true);
+	}
+
+	for (int threads_count : { 1, 4, 16 }) {
+		expiry_benchmark("STRICT ERASE EXPIRY", 1000000, threads_count, false);
+		expiry_benchmark("LAZY ERASE EXPIRY", 1000000, threads_count, true);
+	}
+
+	for (int threads_count : { 1, 2, 4, 8, 16 }) async_benchmark("WRITE-BEHIND QUEUE", read_keys, threads_count);
+
+	for (int accounts : { 16, 100000 }) {
+		for (int threads_count : { 1, 2, 4, 8, 16 }) transfer_benchmark("BANK TRANSFERS", accounts, threads_count);
+	}
+
+	for (int threads_count : { 1, 2, 4, 8 }) iterator_scan_benchmark("PARALLEL ITERATORS", read_keys, threads_count);
+
+	scan_benchmark<AVL<int, int>>("SHARED MUTEX SCAN", read_keys, [](AVL<int, int> &tree) {
+		long long count = 0;
+		for (auto it = tree.begin(); it != tree.end(); ++it) count++;
+		return count;
+		});
+	scan_benchmark<AVLtreePersistent::AVL_persistent<int, int>>("SNAPSHOT SCAN", read_keys,
+		[](AVLtreePersistent::AVL_persistent<int, int> &tree) {
+		auto version = tree.snapshot();
+		long long count = 0;
+		for (auto it = version.begin(); it != version.end(); ++it) count++;
+		return count;
+		});
+
+	vector<pair<int, int>> values(keys.size());
+	for (size_t j = 0; j < keys.size(); ++j) values[j] = make_pair(keys[j], (int)j);
+
+	load_benchmark("UNSORTED LOAD", values);
+	sort(values.begin(), values.end());
+	load_benchmark("SORTED LOAD", values);
+
+	range_benchmark("RANGE ERASE", 1000000);
+
+	union_benchmark("UNION", keys);
+
+	percentile_benchmark("PERCENTILES", keys);
+
+	range_scan_benchmark("RANGE SCAN", 1000000);
+
+	for (int n : { 1000000, 10000000, 100000000 }) freeze_benchmark("FROZEN INDEX", n);
+
+	snapshot_benchmark("MAPPED SNAPSHOT", keys);
 	
 	return 0;
 }